@@ -0,0 +1,362 @@
+/* runs haserl as a CGI program the way a web server would, replaying a mix of
+ * requests from several threads, and reports latency, throughput and the
+ * peak RSS of the haserl processes
+ *
+ * usage: bench [-n requests] [-c concurrency] [-m mix] haserl [options] script
+ * where mix is a list of kind=weight, e.g. get=4,post=3,upload=2,large=1 */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* size of the file sent by upload requests */
+#define UPLOAD_SIZE (256 * 1024)
+/* size of the output asked for by large requests */
+#define LARGE_SIZE (1024 * 1024)
+
+typedef struct {
+	const char *name;
+	char      **env;     /* CGI environment */
+	char       *body;    /* request body (or NULL) */
+	size_t      body_len;
+	int         weight;
+} kind_t;
+
+typedef struct {
+	int    kind;
+	double latency;      /* in seconds */
+	long   maxrss;       /* in KB */
+	int    failed;
+} result_t;
+
+static kind_t kinds[4];
+static int kind_count = 0;
+
+static char **command;
+static result_t *results;
+static int *schedule;         /* the kind of each request */
+static int requests = 1000;
+static int next = 0;          /* the next request to send */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+extern char **environ;
+
+static void
+die(const char *s)
+{
+	fprintf(stderr, "bench: %s\n", s);
+	exit(1);
+}
+
+static char *
+env(const char *name, const char *value)
+{
+	size_t len = strlen(name) + strlen(value) + 2;
+	char *s = malloc(len);
+	if (!s) {
+		die("out of memory");
+	}
+	snprintf(s, len, "%s=%s", name, value);
+	return s;
+}
+
+/* build the environment of a kind of request, on top of our own */
+static char **
+request_env(const char *method, const char *query, const char *content_type, size_t body_len)
+{
+	size_t n = 0;
+	while (environ[n]) n++;
+
+	char **e = calloc(n + 8, sizeof(char *));
+	if (!e) {
+		die("out of memory");
+	}
+	memcpy(e, environ, n * sizeof(char *));
+
+	char length[24];
+	snprintf(length, sizeof(length), "%zu", body_len);
+	e[n++] = env("GATEWAY_INTERFACE", "CGI/1.1");
+	e[n++] = env("REQUEST_METHOD", method);
+	e[n++] = env("QUERY_STRING", query);
+	e[n++] = env("HTTP_COOKIE", "session=0123456789abcdef; lang=en; theme=dark");
+	if (content_type) {
+		e[n++] = env("CONTENT_TYPE", content_type);
+		e[n++] = env("CONTENT_LENGTH", length);
+	}
+	return e;
+}
+
+static void
+add_kind(const char *name, int weight)
+{
+	kind_t *k = &kinds[kind_count++];
+	k->name = name;
+	k->weight = weight;
+	k->body = NULL;
+	k->body_len = 0;
+
+	if (!strcmp(name, "get")) {
+		k->env = request_env("GET", "page=home&sort=date&limit=20", NULL, 0);
+	} else if (!strcmp(name, "post")) {
+		/* a form of 32 fields */
+		k->body = malloc(32 * 32);
+		for (int i = 0; i < 32; i++) {
+			k->body_len += sprintf(k->body + k->body_len, "%sfield%d=value+%d%%21", i ? "&" : "", i, i);
+		}
+		k->env = request_env("POST", "", "application/x-www-form-urlencoded", k->body_len);
+	} else if (!strcmp(name, "upload")) {
+		const char *head = "--BENCH\r\nContent-Disposition: form-data; name=\"title\"\r\n\r\nbench\r\n"
+		                   "--BENCH\r\nContent-Disposition: form-data; name=\"file\"; filename=\"bench.bin\"\r\n"
+		                   "Content-Type: application/octet-stream\r\n\r\n";
+		const char *tail = "\r\n--BENCH--\r\n";
+		k->body = malloc(strlen(head) + UPLOAD_SIZE + strlen(tail));
+		memcpy(k->body, head, strlen(head));
+		k->body_len = strlen(head);
+		for (int i = 0; i < UPLOAD_SIZE; i++) {
+			k->body[k->body_len++] = "abcdefghijklmnopqrstuvwxyz\n"[i % 27];
+		}
+		memcpy(k->body + k->body_len, tail, strlen(tail));
+		k->body_len += strlen(tail);
+		k->env = request_env("POST", "", "multipart/form-data; boundary=BENCH", k->body_len);
+	} else if (!strcmp(name, "large")) {
+		char query[32];
+		snprintf(query, sizeof(query), "size=%d", LARGE_SIZE);
+		k->env = request_env("GET", query, NULL, 0);
+	} else {
+		die("unknown request kind, use get, post, upload or large");
+	}
+}
+
+static void
+parse_mix(char *mix)
+{
+	for (char *s = strtok(mix, ","); s; s = strtok(NULL, ",")) {
+		char *eq = strchr(s, '=');
+		int weight = 1;
+		if (eq) {
+			*eq = 0;
+			weight = atoi(eq + 1);
+		}
+		if (kind_count == sizeof(kinds) / sizeof(kinds[0])) {
+			die("too many request kinds");
+		}
+		if (weight > 0) {
+			add_kind(s, weight);
+		}
+	}
+	if (!kind_count) {
+		die("empty request mix");
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* run one request and wait for it to finish */
+static void
+run(result_t *r)
+{
+	kind_t *k = &kinds[r->kind];
+	int in[2], out[2];
+	if (pipe2(in, O_CLOEXEC) || pipe2(out, O_CLOEXEC)) {
+		die("pipe failed");
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+	posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+
+	double start = now();
+	pid_t pid;
+	int err = posix_spawn(&pid, command[0], &actions, NULL, command, k->env);
+	posix_spawn_file_actions_destroy(&actions);
+	close(in[0]);
+	close(out[1]);
+	if (err) {
+		close(in[1]);
+		close(out[0]);
+		r->failed = 1;
+		return;
+	}
+
+	/* haserl reads the whole body before it writes anything, so the body can
+	 * be written first */
+	for (size_t off = 0; off < k->body_len;) {
+		ssize_t n = write(in[1], k->body + off, k->body_len - off);
+		if (n == -1) {
+			break;
+		}
+		off += n;
+	}
+	close(in[1]);
+
+	/* die() sends a status line, scripts send a Status header */
+	char buf[65536];
+	int error = 0;
+	size_t total = 0;
+	ssize_t n;
+	while ((n = read(out[0], buf, sizeof(buf))) > 0) {
+		if (!total) {
+			error = n >= 5 && !memcmp(buf, "HTTP/", 5);
+		}
+		total += n;
+	}
+	close(out[0]);
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) == -1) {
+		die("wait4 failed");
+	}
+	r->latency = now() - start;
+	r->maxrss = usage.ru_maxrss;
+	r->failed = !WIFEXITED(status) || WEXITSTATUS(status) || !total || error;
+}
+
+static void *
+worker(void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		int i = next < requests ? next++ : -1;
+		pthread_mutex_unlock(&lock);
+		if (i == -1) {
+			return NULL;
+		}
+
+		results[i].kind = schedule[i];
+		run(&results[i]);
+	}
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* print the percentiles of the requests of a kind (-1 for all of them) */
+static void
+report(const char *name, int kind)
+{
+	double *latency = malloc(requests * sizeof(double));
+	int n = 0, failed = 0;
+	long maxrss = 0;
+	for (int i = 0; i < requests; i++) {
+		if (kind != -1 && results[i].kind != kind) {
+			continue;
+		}
+		if (results[i].failed) {
+			failed++;
+			continue;
+		}
+		latency[n++] = results[i].latency;
+		if (results[i].maxrss > maxrss) {
+			maxrss = results[i].maxrss;
+		}
+	}
+
+	if (n) {
+		qsort(latency, n, sizeof(double), compare);
+		printf("%-8s %7d %7d %9.2f %9.2f %9.2f %9.2f %9ld\n", name, n, failed,
+		       latency[n * 50 / 100] * 1e3, latency[n * 95 / 100] * 1e3,
+		       latency[n * 99 / 100] * 1e3, latency[n - 1] * 1e3, maxrss);
+	} else {
+		printf("%-8s %7d %7d\n", name, n, failed);
+	}
+	free(latency);
+}
+
+int
+main(int argc, char **argv)
+{
+	int concurrency = 4;
+	char *mix = NULL;
+
+	int c;
+	while ((c = getopt(argc, argv, "+n:c:m:")) != -1) switch (c) {
+		case 'n':
+			requests = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: bench [-n requests] [-c concurrency] [-m mix] haserl [options] script\n");
+			return 1;
+	}
+	if (optind + 2 > argc) {
+		die("no haserl and script given");
+	} else if (requests < 1 || concurrency < 1) {
+		die("invalid number of requests or concurrency");
+	}
+	command = argv + optind;
+
+	char default_mix[] = "get=4,post=3,upload=2,large=1";
+	parse_mix(mix ? mix : default_mix);
+
+	/* spread the kinds over the requests according to their weights */
+	int total = 0;
+	for (int i = 0; i < kind_count; i++) {
+		total += kinds[i].weight;
+	}
+	schedule = malloc(requests * sizeof(int));
+	results = calloc(requests, sizeof(result_t));
+	if (!schedule || !results) {
+		die("out of memory");
+	}
+	for (int i = 0; i < requests; i++) {
+		int w = i % total, k = 0;
+		while (w >= kinds[k].weight) {
+			w -= kinds[k++].weight;
+		}
+		schedule[i] = k;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_t *threads = malloc(concurrency * sizeof(pthread_t));
+	double start = now();
+	for (int i = 0; i < concurrency; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			die("pthread_create failed");
+		}
+	}
+	for (int i = 0; i < concurrency; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double elapsed = now() - start;
+
+	printf("%d requests, %d concurrent, %.2fs, %.1f requests/s\n\n",
+	       requests, concurrency, elapsed, requests / elapsed);
+	printf("%-8s %7s %7s %9s %9s %9s %9s %9s\n", "kind", "ok", "failed",
+	       "p50 ms", "p95 ms", "p99 ms", "max ms", "rss KB");
+	for (int i = 0; i < kind_count; i++) {
+		report(kinds[i].name, i);
+	}
+	report("all", -1);
+
+	int failed = 0;
+	for (int i = 0; i < requests; i++) {
+		failed += results[i].failed;
+	}
+	return failed != 0;
+}
@@ -0,0 +1,23 @@
+-- the script run by bench.c: a small page, or GET.size bytes of output
+if FORM.file_path then
+	os.remove(FORM.file_path)
+end
+
+print("Content-Type: text/html\r\n\r\n")
+
+local size = tonumber(GET.size)
+if size then
+	local line = string.rep("x", 63) .. "\n"
+	for i = 1, math.floor(size / 64) do
+		print("%s", line)
+	end
+	return
+end
+
+print("<html><body><ul>\n")
+for _, tbl in ipairs({ "GET", "POST", "COOKIE" }) do
+	for k, v in pairs(_G[tbl]) do
+		print("<li>%s.%s = %s</li>\n", tbl, k, v)
+	end
+end
+print("</ul></body></html>\n")
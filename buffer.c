@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -57,4 +58,18 @@ buffer_add(buffer_t *buf, const void *data, size_t size)
 
 	memcpy(buf->ptr, data, size);
 	buf->ptr += size;
+	stats.buffered += size;
+}
+
+/* append everything that can be read from fd
+ * returns -1 on read errors */
+ssize_t
+buffer_read(buffer_t *buf, int fd)
+{
+	char chunk[4096];
+	ssize_t n;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+		buffer_add(buf, chunk, n);
+	}
+	return n;
 }
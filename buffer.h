@@ -3,6 +3,8 @@
 
 #define ALLOC_SIZE 1024
 
+#define buffer_add_literal(buf, s) buffer_add(buf, s, sizeof(s) - 1)
+
 typedef struct {
 	char *data;   /* the data */
 	char *ptr;    /* where to write to next */
@@ -14,5 +16,6 @@ void buffer_alloc(buffer_t *buf, size_t size);
 void buffer_reset(buffer_t *buf);
 void buffer_destroy(buffer_t *buf);
 void buffer_add(buffer_t *buf, const void *data, size_t size);
+ssize_t buffer_read(buffer_t *buf, int fd);
 
 #endif /* _BUFFER_H */
@@ -0,0 +1,29 @@
+#!/bin/sh
+# generate C source embedding the given lua bytecode files as modules
+# foo/bar.luac is named foo.bar, and foo/init.luac is named foo
+
+echo '#include <stddef.h>'
+echo
+echo '#include <lua.h>'
+echo
+echo '#include "common.h"'
+
+i=0
+for f; do
+	echo
+	echo "static const unsigned char module_$i[] = {"
+	od -An -v -tx1 "$f" | sed 's/ \([0-9a-f][0-9a-f]\)/0x\1,/g; s/^/\t/'
+	echo '};'
+	i=$((i + 1))
+done
+
+echo
+echo 'const lua_module_t lua_modules[] = {'
+i=0
+for f; do
+	name=$(echo "${f#./}" | sed 's/\.luac$//; s|/init$||; s|/|.|g')
+	echo "	{ \"$name\", module_$i, sizeof(module_$i) },"
+	i=$((i + 1))
+done
+echo '	{ NULL, NULL, 0 },'
+echo '};'
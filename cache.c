@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "common.h"
+
+/* the cache file is an array of fixed size slots, the first of which holds
+ * the header, organized as an open addressing hash table
+ *
+ * readers don't lock: every slot has a sequence number which is odd while a
+ * writer is updating it, so readers retry if it changed while they copied the
+ * slot. writers serialize on an flock() of the whole file. */
+
+#define CACHE_MAGIC 0x6c726573
+#define CACHE_SLOT_SIZE 4096
+/* number of slots searched for a key */
+#define CACHE_PROBES 8
+/* number of times a reader retries a slot being written, a writer that died
+ * mid-update leaves it odd until the next write */
+#define CACHE_RETRIES 10000
+
+enum { EMPTY, USED, DELETED };
+
+typedef struct {
+	uint32_t magic;
+	uint32_t slots;
+} cache_header_t;
+
+typedef struct {
+	uint32_t seq;         /* odd while the slot is being written */
+	uint32_t state;       /* EMPTY, USED or DELETED */
+	uint64_t hash;        /* hash of the key */
+	int64_t  expires;     /* expiry time (0 for none) */
+	uint32_t key_size;
+	uint32_t value_size;
+	char     data[CACHE_SLOT_SIZE - 32]; /* the key followed by the value */
+} cache_slot_t;
+
+static int cache_fd = -1;
+static cache_slot_t *cache = NULL;  /* cache[0] is the header */
+static uint32_t cache_slots = 0;
+
+/* map the cache file, creating it if necessary */
+static void
+cache_open(lua_State *L)
+{
+	if (cache) {
+		return;
+	}
+
+	size_t len = strlen(global.cache_dir);
+	char *path = xmalloc(len + 14);
+	memcpy(path, global.cache_dir, len);
+	memcpy(path + len, "/haserl.cache", 14);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		free(path);
+		lua_error(L);
+	}
+
+	struct stat st;
+	flock(fd, LOCK_EX);
+	int err = fstat(fd, &st) ? errno : 0;
+	if (!err && !st.st_size) {
+		/* a new cache, the slots are zeroed (EMPTY) by ftruncate */
+		size_t slots = global.cache_size / CACHE_SLOT_SIZE;
+		cache_header_t header = { CACHE_MAGIC, slots ? slots : 1 };
+		if (ftruncate(fd, (off_t)(header.slots + 1) * CACHE_SLOT_SIZE) ||
+		    pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		    fstat(fd, &st)) {
+			err = errno;
+			/* leave an empty file, so the next process tries again
+			 * failing that, remove it so the next process creates a new one */
+			if (ftruncate(fd, 0) && unlink(path)) {
+				flock(fd, LOCK_UN);
+				close(fd);
+				lua_pushfstring(L, "cache: %s, and %s could not be removed: %s", strerror(err), path, strerror(errno));
+				free(path);
+				lua_error(L);
+			}
+		}
+	}
+	flock(fd, LOCK_UN);
+	free(path);
+	if (err) {
+		close(fd);
+		luaL_error(L, "cache: %s", strerror(err));
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		luaL_error(L, "cache: mmap: %s", strerror(errno));
+	}
+
+	cache_header_t *header = map;
+	if (header->magic != CACHE_MAGIC || (off_t)(header->slots + 1) * CACHE_SLOT_SIZE != st.st_size) {
+		munmap(map, st.st_size);
+		close(fd);
+		luaL_error(L, "cache: invalid cache file");
+	}
+
+	cache_fd = fd;
+	cache = map;
+	cache_slots = header->slots;
+}
+
+static cache_slot_t *
+cache_slot(uint64_t hash, int probe)
+{
+	return &cache[1 + (hash + probe) % cache_slots];
+}
+
+/* the sequence number is made odd rather than incremented, so a slot left odd
+ * by a writer that died is fixed by the next write instead of flipping */
+static void
+cache_write_begin(cache_slot_t *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+cache_write_end(cache_slot_t *slot)
+{
+	__atomic_store_n(&slot->seq, (slot->seq | 1) + 1, __ATOMIC_RELEASE);
+}
+
+/* find the slot holding key, only call while holding the lock */
+static cache_slot_t *
+cache_find(uint64_t hash, const char *key, size_t key_size)
+{
+	for (int i = 0; i < CACHE_PROBES && i < cache_slots; i++) {
+		cache_slot_t *slot = cache_slot(hash, i);
+		if (slot->state == EMPTY) {
+			break;
+		} else if (slot->state == USED && slot->hash == hash && slot->key_size == key_size && !memcmp(slot->data, key, key_size)) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/* haserl.cache.get(key) returns the value or nil */
+static int
+lua_cache_get(lua_State *L)
+{
+	size_t key_size;
+	const char *key = luaL_checklstring(L, 1, &key_size);
+	cache_open(L);
+
+	char data[sizeof(cache->data)];
+	if (key_size > sizeof(data)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	uint64_t hash = fnv1a(FNV1A_INIT, key, key_size);
+	int64_t now = time(NULL);
+
+	for (int i = 0; i < CACHE_PROBES && i < cache_slots; i++) {
+		cache_slot_t *slot = cache_slot(hash, i);
+		uint32_t seq, state, value_size;
+		int found, retries = 0;
+		do {
+			while ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1) {
+				if (++retries > CACHE_RETRIES) {
+					/* treat a slot that never settles as a miss */
+					lua_pushnil(L);
+					return 1;
+				}
+			}
+			retries++;
+
+			state = slot->state;
+			found = state == USED && slot->hash == hash && slot->key_size == key_size &&
+			        (!slot->expires || slot->expires > now);
+			value_size = 0;
+			if (found) {
+				value_size = slot->value_size;
+				/* a torn read can yield any size */
+				if (value_size > sizeof(data) - key_size) {
+					value_size = sizeof(data) - key_size;
+				}
+				memcpy(data, slot->data, key_size + value_size);
+			}
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+
+		if (state == EMPTY) {
+			break;
+		} else if (found && !memcmp(data, key, key_size)) {
+			lua_pushlstring(L, data + key_size, value_size);
+			return 1;
+		}
+	}
+
+	lua_pushnil(L);
+	return 1;
+}
+
+/* haserl.cache.set(key, value[, ttl]) returns false if the pair doesn't fit in
+ * a slot */
+static int
+lua_cache_set(lua_State *L)
+{
+	size_t key_size, value_size;
+	const char *key = luaL_checklstring(L, 1, &key_size);
+	const char *value = luaL_checklstring(L, 2, &value_size);
+	lua_Integer ttl = luaL_optinteger(L, 3, 0);
+	cache_open(L);
+
+	if (key_size + value_size > sizeof(cache->data)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	uint64_t hash = fnv1a(FNV1A_INIT, key, key_size);
+	int64_t now = time(NULL);
+
+	flock(cache_fd, LOCK_EX);
+	cache_slot_t *slot = cache_find(hash, key, key_size);
+	if (!slot) {
+		/* take the first free or expired slot
+		 * if there is none, evict the one expiring first */
+		cache_slot_t *victim = NULL;
+		for (int i = 0; i < CACHE_PROBES && i < cache_slots; i++) {
+			cache_slot_t *s = cache_slot(hash, i);
+			if (s->state != USED || (s->expires && s->expires <= now)) {
+				slot = s;
+				break;
+			} else if (!victim || (s->expires && (!victim->expires || s->expires < victim->expires))) {
+				victim = s;
+			}
+		}
+		if (!slot) {
+			slot = victim;
+		}
+	}
+
+	cache_write_begin(slot);
+	slot->state = USED;
+	slot->hash = hash;
+	slot->expires = ttl > 0 ? now + ttl : 0;
+	slot->key_size = key_size;
+	slot->value_size = value_size;
+	memcpy(slot->data, key, key_size);
+	memcpy(slot->data + key_size, value, value_size);
+	cache_write_end(slot);
+	flock(cache_fd, LOCK_UN);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* haserl.cache.delete(key) */
+static int
+lua_cache_delete(lua_State *L)
+{
+	size_t key_size;
+	const char *key = luaL_checklstring(L, 1, &key_size);
+	cache_open(L);
+
+	uint64_t hash = fnv1a(FNV1A_INIT, key, key_size);
+
+	flock(cache_fd, LOCK_EX);
+	cache_slot_t *slot = cache_find(hash, key, key_size);
+	if (slot) {
+		cache_write_begin(slot);
+		slot->state = DELETED;
+		cache_write_end(slot);
+	}
+	flock(cache_fd, LOCK_UN);
+
+	return 0;
+}
+
+/* the name of a file in the cache directory, e.g. cache_dir/0123456789abcdef.ext */
+char *
+cache_path(uint64_t hash, const char *ext)
+{
+	size_t len = strlen(global.cache_dir) + strlen(ext) + 19;
+	char *path = xmalloc(len);
+	snprintf(path, len, "%s/%016llx.%s", global.cache_dir, (unsigned long long)hash, ext);
+	return path;
+}
+
+/* replace a file in the cache directory
+ * the data is written to a temporary file first, so readers never see a
+ * partial file. returns -1 on errors */
+int
+cache_write(const char *path, const struct iovec *iov, int iovcnt)
+{
+	size_t len = strlen(path);
+	char *tmp = xmalloc(len + 8);
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".XXXXXX", 8);
+
+	ssize_t size = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		size += iov[i].iov_len;
+	}
+
+	int ret = -1;
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd != -1) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		close(fd);
+		if (n == size && !rename(tmp, path)) {
+			ret = 0;
+		} else {
+			unlink(tmp);
+		}
+	}
+
+	free(tmp);
+	return ret;
+}
+
+/* push the haserl.cache table, the cache file is only opened on first use */
+void
+cache_register(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushcfunction(L, lua_cache_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, lua_cache_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, lua_cache_delete);
+	lua_setfield(L, -2, "delete");
+}
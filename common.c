@@ -13,14 +13,42 @@
 haserl_t global = {
 	.upload_max = 0,           /* maximum upload size (0 disables file uploads) */
 	.upload_dir = "/tmp",      /* where to upload to */
+	.upload_policy = UPLOAD_ROUND_ROBIN, /* how to spread uploads over upload_dir */
+	.raw_body = 0,             /* copy the POST body into a Lua string */
+	.body = NULL,
+	.body_len = 0,
+	.profile_file = NULL,      /* where to write folded stacks (NULL disables profiling) */
+	.profile_rate = 1000,      /* instructions between samples */
+	.instr_max = 0,            /* instruction budget for the script (0 for none) */
+	.time_max = 0,             /* wall clock budget for the script (0 for none) */
+	.defer_max = 0,            /* wall clock budget after the response (0 for none) */
+	.gc_pause = 0,             /* collector pause (0 for the lua default) */
+	.gc_stepmul = 0,           /* collector step multiplier (0 for the lua default) */
+	.gc_threshold = 0,         /* heap size at which the collector starts (0 for always) */
+	.memory_report = 0,        /* report memory statistics at exit */
+	.field_max = 0,            /* maximum number of pairs per table (0 for none) */
+	.key_max = 0,              /* maximum key length (0 for none) */
+	.size_max = 0,             /* maximum decoded size per table (0 for none) */
+	.cache_dir = NULL,         /* where the shared cache lives (NULL disables it) */
+	.cache_size = 4096 * 1024, /* size of the shared cache */
+	.template = 0,             /* run the script as plain lua */
+	.upload_pipeline = 0,      /* write uploaded files from the main thread */
+	.upload_direct = 0,        /* write uploaded files through the page cache */
+	.etag = 0,                 /* send responses as is */
+	.cookie_key = NULL,        /* no key to sign cookies with */
+	.cookie_key_len = 0,
+	.signed_cookies = NULL,    /* pass every cookie to the script as is */
 	.L = NULL,
 };
 
+stats_t stats = { 0, 0, 0 };
+
 /* allocate memory or die, busybox style. */
 void *
 xmalloc(size_t size)
 {
 	void *buf = malloc(size);
+	stats.allocs++;
 	if (!buf) {
 		die_status(errno, "malloc: %s", strerror(errno));
 	}
@@ -32,6 +60,7 @@ xmalloc(size_t size)
 void *
 xrealloc(void *buf, size_t size)
 {
+	stats.allocs++;
 	if (!(buf = realloc(buf, size)) && size) {
 		die_status(errno, "realloc: %s", strerror(errno));
 	}
@@ -49,6 +78,29 @@ xstrdup(const char *s)
 	return ret;
 }
 
+/* strndup or die */
+char *
+xstrndup(const char *s, size_t n)
+{
+	char *ret = strndup(s, n);
+	if (!ret) {
+		die_status(errno, "strndup: %s", strerror(errno));
+	}
+	return ret;
+}
+
+/* 64 bit FNV-1a, start with FNV1A_INIT */
+uint64_t
+fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *s = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= s[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
 void
 drain(int fd)
 {
@@ -59,13 +111,13 @@ drain(int fd)
 /* print an error message and terminate.
  * if there's a request method, HTTP headers are added. */
 static void
-vdie(int status, const char *s, va_list ap)
+vdie(int status, const char *http_status, const char *s, va_list ap)
 {
 	if (getenv("REQUEST_METHOD")) {
-		dprintf(1, "HTTP/1.0 500 Server Error\r\n"
+		dprintf(1, "%s"
 		        "Content-Type: text/html\r\n\r\n"
 		        "<html><body><b><font color='#C00'>" PACKAGE
-		        " CGI Error</font></b><br><pre>\r\n");
+		        " CGI Error</font></b><br><pre>\r\n", http_status);
 		vdprintf(1, s, ap);
 		dprintf(1, "\r\n</pre></body></html>");
 	} else {
@@ -74,7 +126,9 @@ vdie(int status, const char *s, va_list ap)
 	}
 
 	drain(0);
-	lua_close(global.L);
+	if (global.L) {
+		lua_close(global.L);
+	}
 
 	exit(status);
 }
@@ -84,7 +138,7 @@ die_status(int status, const char *s, ...)
 {
 	va_list ap;
 	va_start(ap, s);
-	vdie(status, s, ap);
+	vdie(status, "HTTP/1.0 500 Server Error\r\n", s, ap);
 	va_end(ap);
 }
 
@@ -93,6 +147,16 @@ die(const char *s, ...)
 {
 	va_list ap;
 	va_start(ap, s);
-	vdie(-1, s, ap);
+	vdie(-1, "HTTP/1.0 500 Server Error\r\n", s, ap);
+	va_end(ap);
+}
+
+/* like die(), but tell the client to try again later */
+void
+die_unavailable(const char *s, ...)
+{
+	va_list ap;
+	va_start(ap, s);
+	vdie(-1, UNAVAILABLE_STATUS, s, ap);
 	va_end(ap);
 }
@@ -1,24 +1,103 @@
 #ifndef _COMMON_H
 #define _COMMON_H
 
+#include <sys/types.h>
+
 #include "util.h"
 
+struct iovec;
+
 /* 128K */
 #define CHUNK_SIZE 128 * 1024
 
+/* status line and headers sent when a script exceeds its budget */
+#define UNAVAILABLE_STATUS "HTTP/1.0 503 Service Unavailable\r\nRetry-After: 5\r\n"
+
 typedef struct {
 	size_t     upload_max;    /* maximum upload size (0 for none) */
-	char      *upload_dir;    /* where we upload to               */
+	char      *upload_dir;    /* where we upload to (colon separated) */
+	int        upload_policy; /* how to choose from upload_dir    */
+	int        raw_body;      /* keep the POST body in C memory   */
+	char      *body;          /* raw POST body (with raw_body)    */
+	size_t     body_len;      /* length of the raw POST body      */
+	char      *profile_file;  /* folded stack output (or NULL)    */
+	int        profile_rate;  /* instructions between samples     */
+	size_t     instr_max;     /* instruction budget (0 for none)  */
+	unsigned   time_max;      /* time budget in seconds (0 for none) */
+	unsigned   defer_max;     /* time budget after the response   */
+	int        gc_pause;      /* collector pause (0 for default)  */
+	int        gc_stepmul;    /* collector step multiplier        */
+	size_t     gc_threshold;  /* heap size to start collecting at */
+	int        memory_report; /* report memory statistics at exit */
+	size_t     field_max;     /* pairs per table (0 for none)     */
+	size_t     key_max;       /* key length (0 for none)          */
+	size_t     size_max;      /* decoded bytes per table (0 for none) */
+	char      *cache_dir;     /* shared cache directory (or NULL) */
+	size_t     cache_size;    /* size of the shared cache         */
+	int        template;      /* run the script as a template     */
+	int        upload_pipeline; /* write uploads from a thread    */
+	int        upload_direct; /* write uploads with O_DIRECT      */
+	int        etag;          /* add ETags, answer with 304       */
+	char      *cookie_key;    /* key for signed cookies (or NULL) */
+	size_t     cookie_key_len; /* length of cookie_key            */
+	char      *signed_cookies; /* cookies verified while parsing (comma separated) */
 	lua_State *L;             /* lua state                        */
 } haserl_t;
 
 extern haserl_t global;
 
+/* upload_policy */
+enum { UPLOAD_ROUND_ROBIN, UPLOAD_FREE, UPLOAD_HASH };
+
+/* a lua module compiled into the binary, see bundle.sh */
+typedef struct {
+	const char          *name;
+	const unsigned char *data;  /* bytecode */
+	size_t               size;
+} lua_module_t;
+
+extern const lua_module_t lua_modules[];
+
+/* decoded input added to a table so far, see field_check() */
+typedef struct {
+	size_t fields;
+	size_t size;
+} field_count_t;
+
 void haserl(void);
+char *haserl_lookup(const char *tbl, const char *name, size_t *size);
+const char *cookie_verify(const char *name, size_t name_size, const char *cookie, size_t size,
+                          const char *key, size_t key_size, size_t *value_size, int64_t *expires);
+void sign_register(lua_State *L);
+void field_check(field_count_t *count, size_t key_size, size_t value_size);
 void multipart_handler(void);
 
+int input_init(void);
+ssize_t input_read(int fd, void *buf, size_t size);
+
+int upload_write(int fd, const char *data, size_t size);
+int upload_flush(void);
+const char *upload_dir(const char *name, size_t *len);
+
 void lua_init(void);
 void lua_set(const char *tbl, const char *key, size_t key_size, const char *value, size_t value_size);
+void lua_set_body(void);
 void lua_exec(const char *filename);
+void lua_run_deferred(void);
+void lua_report(void);
+
+void cache_register(lua_State *L);
+char *cache_path(uint64_t hash, const char *ext);
+int cache_write(const char *path, const struct iovec *iov, int iovcnt);
+
+void response_write(const char *data, size_t size);
+int response_cache_serve(const char *filename);
+void response_cache_store(const char *filename, const char *data, size_t size);
+void response_cache_register(lua_State *L);
+
+int template_load(lua_State *L, const char *filename);
+
+void profile_start(lua_State *L);
+void profile_sample(lua_State *L);
 
 #endif /* _COMMON_H */
@@ -53,31 +53,96 @@ unescape_url(char *url)
 	return ptr - url;
 }
 
-/* add a pair of strings delimited on '=' to a buffer */
+/* account for a decoded pair before it is added to a table
+ * dies if any of the configured limits is exceeded */
+void
+field_check(field_count_t *count, size_t key_size, size_t value_size)
+{
+	count->fields++;
+	count->size += key_size + value_size;
+
+	if (global.field_max && count->fields > global.field_max) {
+		die("Too many form fields");
+	} else if (global.key_max && key_size > global.key_max) {
+		die("Form field name larger than allowed limits");
+	} else if (global.size_max && count->size > global.size_max) {
+		die("Form data larger than allowed limits");
+	}
+}
+
+/* count the tokens strtok() would return, so an oversized input is rejected
+ * before any of it is decoded */
+static void
+count_pairs(const char *s, const char *delim)
+{
+	if (!global.field_max) {
+		return;
+	}
+
+	size_t n = 0;
+	while (*(s += strspn(s, delim))) {
+		if (++n > global.field_max) {
+			die("Too many form fields");
+		}
+		s += strcspn(s, delim);
+	}
+}
+
+/* is the cookie one of --signed-cookie */
+static int
+is_signed(const char *name, size_t size)
+{
+	const char *s = global.signed_cookies;
+	while (s) {
+		size_t len = strcspn(s, ",");
+		if (len == size && !memcmp(s, name, size)) {
+			return 1;
+		}
+		s = s[len] ? s + len + 1 : NULL;
+	}
+	return 0;
+}
+
+/* add a pair of strings delimited on '=' to a buffer
+ * signed cookies are replaced by their value, or dropped if they are invalid */
 static void
-lua_add_pair(const char *tbl, char *str)
+lua_add_pair(const char *tbl, char *str, field_count_t *count, int cookie)
 {
 	char *value = strchr(str, '=');
+	size_t key_size, value_size = 0;
 	if (value) {
 		*value = 0;
-		size_t key_size = unescape_url(str);
-		size_t value_size = unescape_url(++value);
-		lua_set(tbl, str, key_size, value, value_size);
+		key_size = unescape_url(str);
+		value_size = unescape_url(++value);
 	} else {
-		size_t size = unescape_url(str);
-		lua_set(tbl, str, size, "", 0);
+		key_size = unescape_url(str);
+		value = "";
+	}
+	field_check(count, key_size, value_size);
+
+	if (cookie && is_signed(str, key_size)) {
+		int64_t expires;
+		if (cookie_verify(str, key_size, value, value_size, global.cookie_key,
+		                  global.cookie_key_len, &value_size, &expires)) {
+			return;
+		}
 	}
+
+	lua_set(tbl, str, key_size, value, value_size);
 }
 
 static void
 read_cookie(const char *tbl, char *cookie)
 {
+	field_count_t count = { 0, 0 };
+	count_pairs(cookie, ";");
+
 	/* split on ; to extract name value pairs */
 	char *token = strtok(cookie, ";");
 	while (token) {
 		/* skip leading spaces */
 		while (*token == ' ') token++;
-		lua_add_pair(tbl, token);
+		lua_add_pair(tbl, token, &count, 1);
 		token = strtok(NULL, ";");
 	}
 }
@@ -85,6 +150,9 @@ read_cookie(const char *tbl, char *cookie)
 static void
 read_query(const char *tbl, char *query)
 {
+	field_count_t count = { 0, 0 };
+	count_pairs(query, "&");
+
 	/* change pluses into spaces */
 	for (char *s = query; *s; s++) {
 		if (*s == '+') *s = ' ';
@@ -93,11 +161,60 @@ read_query(const char *tbl, char *query)
 	/* split on & to extract name value pairs */
 	char *token = strtok(query, "&");
 	while (token) {
-		lua_add_pair(tbl, token);
+		lua_add_pair(tbl, token, &count, 0);
 		token = strtok(NULL, "&");
 	}
 }
 
+/* find the decoded value of a cookie ("COOKIE") or query string element ("GET")
+ * without going through lua
+ * returns an allocated copy of the last value, like the tables would hold */
+char *
+haserl_lookup(const char *tbl, const char *name, size_t *size)
+{
+	int cookie = !strcmp(tbl, "COOKIE");
+	char *str = getenv(cookie ? "HTTP_COOKIE" : "QUERY_STRING");
+	if (!str) {
+		return NULL;
+	}
+
+	str = xstrdup(str);
+	if (!cookie) {
+		for (char *s = str; *s; s++) {
+			if (*s == '+') *s = ' ';
+		}
+	}
+
+	char *ret = NULL;
+	size_t name_size = strlen(name);
+	const char *delim = cookie ? ";" : "&";
+	char *token = strtok(str, delim);
+	while (token) {
+		if (cookie) {
+			while (*token == ' ') token++;
+		}
+
+		char *value = strchr(token, '=');
+		if (value) {
+			*value++ = 0;
+		}
+
+		if (unescape_url(token) == name_size && !memcmp(token, name, name_size)) {
+			free(ret);
+			*size = value ? unescape_url(value) : 0;
+			ret = xmalloc(*size + 1);
+			if (value) {
+				memcpy(ret, value, *size);
+			}
+		}
+
+		token = strtok(NULL, delim);
+	}
+
+	free(str);
+	return ret;
+}
+
 /* read CGI variables from stdin (for POST queries) */
 static void
 read_form(void)
@@ -117,26 +234,47 @@ read_form(void)
 		die("Content length larger than allowed limits");
 	}
 
+	int encoded = input_init();
+
 	char *content_type = getenv("CONTENT_TYPE");
 	if (content_type && !strncasecmp(content_type, "multipart/form-data", 19)) {
 		multipart_handler();
 		return;
 	}
 
+	int urlencoded = content_type && !strncasecmp(content_type, "application/x-www-form-urlencoded", 33);
+
+	/* maximum size for non-multipart/form-data requests is CHUNK_SIZE
+	 * a raw body is only bounded by the content length (or the upload limit if
+	 * it is compressed), so read it into a single allocation that can be
+	 * handed over to the script. it grows as the data arrives, rather than
+	 * trusting the content length or the compression ratio */
+	size_t limit = CHUNK_SIZE;
+	if (global.raw_body && !urlencoded) {
+		limit = (encoded ? global.upload_max : max_len) + 1;
+	}
+
 	buffer_t buf;
-	buffer_alloc(&buf, CHUNK_SIZE);
+	buffer_alloc(&buf, limit < CHUNK_SIZE ? limit : CHUNK_SIZE);
 
-	ssize_t n = read(0, buf.ptr, CHUNK_SIZE);
+	ssize_t n = input_read(0, buf.ptr, buf.limit - buf.ptr);
 	while (n > 0) {
 		buf.ptr += n;
 
-		/* maximum size for non-multipart/form-data requests is CHUNK_SIZE */
-		if (buf.ptr - buf.data >= CHUNK_SIZE) {
+		if (buf.ptr - buf.data >= limit) {
 			buffer_destroy(&buf);
 			die("Reached maximum allowed input length");
 		}
 
-		n = read(0, buf.ptr, buf.limit - buf.ptr);
+		if (buf.ptr == buf.limit) {
+			size_t used = buf.ptr - buf.data;
+			size_t size = used * 2 < limit ? used * 2 : limit;
+			buf.data = xrealloc(buf.data, size);
+			buf.ptr = buf.data + used;
+			buf.limit = buf.data + size;
+		}
+
+		n = input_read(0, buf.ptr, buf.limit - buf.ptr);
 	}
 
 	if (n == -1) {
@@ -144,10 +282,16 @@ read_form(void)
 		die_status(errno, "read: %s", strerror(errno));
 	}
 
-	if (content_type && !strncasecmp(content_type, "application/x-www-form-urlencoded", 33)) {
+	if (urlencoded) {
 		/* add the ASCIIZ */
 		buffer_add(&buf, "", 1);
 		read_query("POST", buf.data);
+	} else if (global.raw_body) {
+		/* keep the buffer around instead of copying it into a lua string */
+		global.body = buf.data;
+		global.body_len = buf.ptr - buf.data;
+		lua_set_body();
+		return;
 	} else {
 		/* treat input as an opaque octet stream */
 		lua_set("POST", "body", 4, buf.data, buf.ptr - buf.data);
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <lua.h>
+
+#include "common.h"
+
+/* request bodies are read through input_read(), which decodes them according
+ * to their Content-Encoding */
+
+#ifdef HAVE_ZLIB
+static int encoded = 0;
+static int done = 0;          /* the end of the compressed stream was reached */
+static size_t total = 0;      /* decompressed bytes */
+static z_stream stream;
+static unsigned char in[CHUNK_SIZE];
+#endif
+
+/* set up decoding of the request body
+ * returns 1 if the body is compressed */
+int
+input_init(void)
+{
+	char *encoding = getenv("HTTP_CONTENT_ENCODING");
+	if (!encoding || !*encoding || !strcasecmp(encoding, "identity")) {
+		return 0;
+	}
+
+#ifdef HAVE_ZLIB
+	int deflate = !strcasecmp(encoding, "deflate");
+	if (deflate || !strcasecmp(encoding, "gzip") || !strcasecmp(encoding, "x-gzip")) {
+		memset(&stream, 0, sizeof(stream));
+
+		/* deflate is meant to have a zlib header, but some clients send a
+		 * raw deflate stream, so look at the first two bytes */
+		int bits = 32 + MAX_WBITS; /* gzip or zlib headers */
+		if (deflate) {
+			size_t n = 0;
+			while (n < 2) {
+				ssize_t r = read(0, in + n, sizeof(in) - n);
+				if (r == -1) {
+					die_status(errno, "read: %s", strerror(errno));
+				} else if (!r) {
+					break;
+				}
+				n += r;
+			}
+			if (n >= 2 && ((in[0] & 0x0f) != Z_DEFLATED || (in[0] << 8 | in[1]) % 31)) {
+				bits = -MAX_WBITS;
+			}
+			stream.next_in = in;
+			stream.avail_in = n;
+		}
+
+		if (inflateInit2(&stream, bits) != Z_OK) {
+			die("inflateInit2: %s", stream.msg ? stream.msg : "failed");
+		}
+		encoded = 1;
+		return 1;
+	}
+#endif
+
+	die("Unsupported content encoding: %s", encoding);
+	return 0;
+}
+
+/* read (and decompress) up to size bytes of the request body from fd
+ * the decompressed size is limited to upload_max */
+ssize_t
+input_read(int fd, void *buf, size_t size)
+{
+#ifdef HAVE_ZLIB
+	if (!encoded) {
+		return read(fd, buf, size);
+	}
+
+	stream.next_out = buf;
+	stream.avail_out = size;
+	while (!done && stream.avail_out == size) {
+		if (!stream.avail_in) {
+			ssize_t n = read(fd, in, sizeof(in));
+			if (n == -1) {
+				return -1;
+			} else if (!n) {
+				die("Truncated compressed request body");
+			}
+			stream.next_in = in;
+			stream.avail_in = n;
+		}
+
+		int ret = inflate(&stream, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			done = 1;
+			inflateEnd(&stream);
+		} else if (ret != Z_OK) {
+			die("Invalid compressed request body");
+		}
+	}
+
+	size_t n = size - stream.avail_out;
+	total += n;
+	if (total > global.upload_max) {
+		die("Reached maximum allowable input length");
+	}
+	return n;
+#else
+	return read(fd, buf, size);
+#endif
+}
@@ -1,13 +1,189 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <sys/resource.h>
 
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#ifdef LUA_JITLIBNAME
+#include <luajit.h>
+#endif
 
 #include "common.h"
 
+static size_t heap_peak = 0;  /* largest lua heap seen, in bytes */
+static int gc_pause = 0;      /* pause to restore after the first collection */
+
+static size_t
+heap_size(lua_State *L)
+{
+	return (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+/* sample the size of the lua heap for the memory report */
+static void
+heap_sample(lua_State *L)
+{
+	size_t heap = heap_size(L);
+	if (heap > heap_peak) {
+		heap_peak = heap;
+	}
+}
+
+/* __gc of an unreachable userdata, run at the end of a collection cycle
+ * the pause is restored after the first one, and the heap is sampled after
+ * each one while memory is reported, as hooks don't run in compiled code */
+static int
+lua_gc_cycle(lua_State *L)
+{
+	if (gc_pause) {
+		lua_gc(L, LUA_GCSETPAUSE, gc_pause);
+		gc_pause = 0;
+	}
+	if (global.memory_report) {
+		heap_sample(L);
+		/* another one for the next cycle */
+		lua_newuserdata(L, 1);
+		lua_getmetatable(L, 1);
+		lua_setmetatable(L, -2);
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+/* leave an unreachable userdata behind, so lua_gc_cycle() runs at the end of
+ * the next collection cycle */
+static void
+gc_sentinel(lua_State *L)
+{
+	lua_newuserdata(L, 1);
+	lua_newtable(L);
+	lua_pushcfunction(L, lua_gc_cycle);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+}
+
+/* hold off the first collection until the heap reaches gc_threshold
+ * the pause is stretched for the first cycle rather than the collector being
+ * stopped, since nothing would be sure to restart it (the count hook doesn't
+ * run in compiled code or C functions) */
+static void
+gc_delay(lua_State *L)
+{
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	size_t heap = heap_size(L);
+	if (global.gc_threshold <= heap) {
+		return;
+	}
+
+	size_t pause = global.gc_threshold / heap * 100;
+	gc_pause = lua_gc(L, LUA_GCSETPAUSE, pause < INT_MAX ? pause : INT_MAX);
+	/* the threshold of the next cycle is computed when a cycle ends */
+	lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+/* the count hook doesn't run inside code compiled by LuaJIT, so the compiler
+ * is turned off and its traces flushed when the hook has to stop a script */
+static void
+jit_off(lua_State *L)
+{
+#ifdef LUAJIT_VERSION
+	luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+	luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_FLUSH);
+#endif
+}
+
+/* check the (offset, length) arguments against the raw body
+ * returns 0 if there is no raw body */
+static int
+body_range(lua_State *L, size_t *offset, size_t *length)
+{
+	if (!global.body) {
+		return 0;
+	}
+
+	lua_Integer off = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, off >= 0 && off <= global.body_len, 1, "offset out of range");
+	lua_Integer len = luaL_optinteger(L, 2, global.body_len - off);
+	luaL_argcheck(L, len >= 0, 2, "negative length");
+
+	*offset = off;
+	*length = len > global.body_len - off ? global.body_len - off : len;
+	return 1;
+}
+
+/* haserl.body_slice(offset[, length]) returns a pointer into the raw body and
+ * the length of the slice, e.g. for use with ffi.cast() */
+static int
+lua_body_slice(lua_State *L)
+{
+	size_t offset, length;
+	if (!body_range(L, &offset, &length)) {
+		return 0;
+	}
+
+	lua_pushlightuserdata(L, global.body + offset);
+	lua_pushinteger(L, length);
+	return 2;
+}
+
+/* haserl.body_sub(offset[, length]) copies only the given slice of the raw
+ * body into a string */
+static int
+lua_body_sub(lua_State *L)
+{
+	size_t offset, length;
+	if (!body_range(L, &offset, &length)) {
+		return 0;
+	}
+
+	lua_pushlstring(L, global.body + offset, length);
+	return 1;
+}
+
+/* package.preload loader for a bundled module */
+static int
+lua_load_module(lua_State *L)
+{
+	const lua_module_t *module = lua_touserdata(L, lua_upvalueindex(1));
+	if (luaL_loadbuffer(L, (const char *)module->data, module->size, module->name)) {
+		return lua_error(L);
+	}
+	lua_pushstring(L, module->name);
+	lua_call(L, 1, 1);
+	return 1;
+}
+
+/* registry key of the functions to run after the response */
+#define DEFERRED "haserl.after_response"
+
+/* haserl.after_response(fn) runs fn once the response has been sent */
+static int
+lua_defer(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, DEFERRED);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, DEFERRED);
+	}
+
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+	lua_pop(L, 1);
+	return 0;
+}
+
 void
 lua_init(void)
 {
@@ -15,6 +191,35 @@ lua_init(void)
 	global.L = L;
 	luaL_openlibs(L);
 
+	if (global.gc_pause) {
+		lua_gc(L, LUA_GCSETPAUSE, global.gc_pause);
+	}
+	if (global.gc_stepmul) {
+		lua_gc(L, LUA_GCSETSTEPMUL, global.gc_stepmul);
+	}
+	if (global.instr_max) {
+		jit_off(L);
+	}
+	/* short scripts may never need to collect at all */
+	if (global.gc_threshold) {
+		gc_delay(L);
+	}
+	if (gc_pause || global.memory_report) {
+		gc_sentinel(L);
+	}
+
+	/* bundled modules are required without searching package.path */
+	if (lua_modules[0].name) {
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "preload");
+		for (const lua_module_t *module = lua_modules; module->name; module++) {
+			lua_pushlightuserdata(L, (void *)module);
+			lua_pushcclosure(L, lua_load_module, 1);
+			lua_setfield(L, -2, module->name);
+		}
+		lua_pop(L, 2);
+	}
+
 	lua_newtable(L);
 	lua_setglobal(L, "GET");
 
@@ -26,6 +231,22 @@ lua_init(void)
 
 	lua_newtable(L);
 	lua_setglobal(L, "COOKIE");
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lua_body_slice);
+	lua_setfield(L, -2, "body_slice");
+	lua_pushcfunction(L, lua_body_sub);
+	lua_setfield(L, -2, "body_sub");
+	lua_pushcfunction(L, lua_defer);
+	lua_setfield(L, -2, "after_response");
+	sign_register(L);
+	if (global.cache_dir) {
+		cache_register(L);
+		lua_setfield(L, -2, "cache");
+		response_cache_register(L);
+		lua_setfield(L, -2, "cache_response");
+	}
+	lua_setglobal(L, "haserl");
 }
 
 void
@@ -44,9 +265,116 @@ lua_set(const char *tbl, const char *key, size_t key_size, const char *value, si
 	lua_pushlstring(L, key, key_size);
 	lua_pushlstring(L, value, value_size);
 	lua_settable(L, -3);
+	stats.copied += key_size + value_size;
+	lua_pop(L, 1);
+}
+
+/* expose the raw POST body as POST.body (a light userdata) and POST.body_len */
+void
+lua_set_body(void)
+{
+	lua_State *L = global.L;
+
+	lua_getglobal(L, "POST");
+	lua_pushlightuserdata(L, global.body);
+	lua_setfield(L, -2, "body");
+	lua_pushinteger(L, global.body_len);
+	lua_setfield(L, -2, "body_len");
 	lua_pop(L, 1);
 }
 
+/* instructions between hook calls when not profiling */
+#define HOOK_COUNT 1000
+
+#ifdef LUAJIT_VERSION
+/* LuaJIT samples the stack itself, see profile_start() */
+#define HOOK_PROFILE 0
+#else
+#define HOOK_PROFILE (global.profile_file != NULL)
+#endif
+
+static volatile sig_atomic_t budget_exceeded = 0;
+static size_t instructions = 0;      /* instructions run since budget_start() */
+static size_t instruction_limit = 0;
+static int hook_count = 0;
+static int cgi = 0;
+
+static void
+lua_hook(lua_State *L, lua_Debug *ar)
+{
+	if (HOOK_PROFILE) {
+		profile_sample(L);
+	}
+	if (global.memory_report) {
+		heap_sample(L);
+	}
+
+	instructions += hook_count;
+	if (instruction_limit && instructions >= instruction_limit) {
+		budget_exceeded = 1;
+	}
+	/* raised again on every hook, in case the script catches it with pcall */
+	if (budget_exceeded) {
+		luaL_error(L, "Script exceeded its execution budget");
+	}
+}
+
+static void
+lua_alarm(int sig)
+{
+	if (budget_exceeded) {
+		/* no hook ran during the grace period (e.g. in LuaJIT compiled code)
+		 * only async-signal-safe calls from here on */
+		static const char response[] = UNAVAILABLE_STATUS
+			"Content-Type: text/html\r\n\r\n"
+			"<html><body><b><font color='#C00'>" PACKAGE
+			" CGI Error</font></b><br><pre>\r\n"
+			"Script exceeded its execution budget"
+			"\r\n</pre></body></html>";
+		if (cgi) {
+			ssize_t n = write(1, response, sizeof(response) - 1);
+			(void)n;
+		}
+		_exit(-1);
+	}
+
+	budget_exceeded = 1;
+	alarm(1);
+}
+
+/* limit the lua code run from now on to max_instructions and max_time
+ * seconds (0 disables either) */
+static void
+budget_start(size_t max_instructions, unsigned max_time)
+{
+	lua_State *L = global.L;
+
+	budget_exceeded = 0;
+	instructions = 0;
+	instruction_limit = max_instructions;
+	cgi = getenv("REQUEST_METHOD") != NULL;
+
+	hook_count = HOOK_PROFILE ? global.profile_rate : HOOK_COUNT;
+	if (HOOK_PROFILE || max_instructions || max_time || global.memory_report) {
+		lua_sethook(L, lua_hook, LUA_MASKCOUNT, hook_count);
+	}
+
+	if (max_time) {
+		signal(SIGALRM, lua_alarm);
+		alarm(max_time);
+	}
+}
+
+static void
+budget_stop(void)
+{
+	alarm(0);
+	lua_sethook(global.L, NULL, 0, 0);
+	if (global.memory_report) {
+		heap_sample(global.L);
+	}
+}
+
 static int
 lua_print(lua_State *L)
 {
@@ -79,9 +407,24 @@ lua_exec(const char *filename)
 	lua_pushcfunction(L, lua_print);
 	lua_setglobal(L, "print");
 
-	if (luaL_loadfile(L, filename) || lua_pcall(L, 0, 0, 0)) {
+	if (global.profile_file) {
+		profile_start(L);
+	}
+
+	if (global.template ? template_load(L, filename) : luaL_loadfile(L, filename)) {
+		die("%s", lua_tostring(L, -1));
+	}
+
+	budget_start(global.instr_max, global.time_max);
+	if (lua_pcall(L, 0, 0, 0)) {
+		/* the pending output is discarded along with the lua state */
+		if (budget_exceeded) {
+			budget_stop();
+			die_unavailable("%s", lua_tostring(L, -1));
+		}
 		die("%s", lua_tostring(L, -1));
 	}
+	budget_stop();
 
 	lua_getglobal(L, "table");
 	lua_getfield(L, -1, "concat");
@@ -97,9 +440,71 @@ lua_exec(const char *filename)
 		die("lua_tolstring: BUFFER not accessible");
 	}
 
-	ssize_t n = write(1, buffer, len);
+	response_write(buffer, len);
+
+	if (global.cache_dir) {
+		response_cache_store(filename, buffer, len);
+	}
+	lua_pop(L, 1);
+}
+
+/* run the functions passed to haserl.after_response()
+ * stdout is closed first, so the web server can finish the request */
+void
+lua_run_deferred(void)
+{
+	lua_State *L = global.L;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, DEFERRED);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	/* send what the script wrote through io.write() before fd 1 is replaced
+	 * keep fd 1 taken, anything written to it is discarded */
+	fflush(stdout);
+	int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (fd == -1 || dup2(fd, 1) == -1) {
+		close(1);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+
+	/* nobody waits for deferred work, so it may as well be interpreted if that
+	 * lets the time limit stop it */
+	if (global.defer_max) {
+		jit_off(L);
+	}
+
+	/* errors can't be sent to the client anymore, so they go to stderr */
+	budget_start(global.instr_max, global.defer_max);
+	size_t n = lua_objlen(L, -1);
+	for (size_t i = 1; i <= n && !budget_exceeded; i++) {
+		lua_rawgeti(L, -1, i);
+		if (lua_pcall(L, 0, 0, 0)) {
+			dprintf(2, "%s\n", lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	budget_stop();
+
 	lua_pop(L, 1);
-	if (n != len || n == -1) {
-		die_status(errno, "write: %s", strerror(errno));
+}
+
+/* write memory statistics to stderr */
+void
+lua_report(void)
+{
+	heap_sample(global.L);
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		usage.ru_maxrss = 0;
 	}
+
+	dprintf(2, PACKAGE ": lua heap peak %zuK, rss peak %ldK, %zu allocations, "
+	        "%zu bytes buffered, %zu bytes passed to lua\n",
+	        heap_peak / 1024, usage.ru_maxrss, stats.allocs, stats.buffered, stats.copied);
 }
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <grp.h>
 #include <getopt.h>
@@ -10,6 +12,7 @@
 #include <lauxlib.h>
 
 #include "common.h"
+#include "buffer.h"
 
 /*
  * split a string into an argv[] array, and return the number of elements.
@@ -117,6 +120,28 @@ main(int argc, char **argv)
 		{ "version",        no_argument,       NULL, 'v' },
 		{ "upload-limit",   required_argument, NULL, 'u' },
 		{ "upload-dir",     required_argument, NULL, 'U' },
+		{ "raw-body",       no_argument,       NULL, 'r' },
+		{ "profile",        required_argument, NULL, 'p' },
+		{ "profile-rate",   required_argument, NULL, 'P' },
+		{ "instruction-limit", required_argument, NULL, 'i' },
+		{ "time-limit",     required_argument, NULL, 't' },
+		{ "defer-limit",    required_argument, NULL, 'd' },
+		{ "field-limit",    required_argument, NULL, 'f' },
+		{ "key-limit",      required_argument, NULL, 'k' },
+		{ "size-limit",     required_argument, NULL, 's' },
+		{ "cache-dir",      required_argument, NULL, 'c' },
+		{ "cache-size",     required_argument, NULL, 'C' },
+		{ "template",       no_argument,       NULL, 'T' },
+		{ "upload-pipeline", no_argument,      NULL, 'w' },
+		{ "upload-direct",  no_argument,       NULL, 'D' },
+		{ "upload-policy",  required_argument, NULL, 'o' },
+		{ "etag",           no_argument,       NULL, 'e' },
+		{ "gc-pause",       required_argument, NULL, 'g' },
+		{ "gc-stepmul",     required_argument, NULL, 'G' },
+		{ "gc-threshold",   required_argument, NULL, 'z' },
+		{ "memory-report",  no_argument,       NULL, 'm' },
+		{ "cookie-key",     required_argument, NULL, 'K' },
+		{ "signed-cookie",  required_argument, NULL, 'S' },
 		{ NULL,             0,                 NULL, 0   },
 	};
 
@@ -147,20 +172,98 @@ main(int argc, char **argv)
 		global.upload_dir = tmpdir;
 	}
 
+	char *cookie_key = NULL;
 	int c;
-	while ((c = getopt_long(ac, av, "+hvu:U:", options, NULL)) != -1) switch (c) {
+	while ((c = getopt_long(ac, av, "+hvu:U:rp:P:i:t:d:f:k:s:c:C:TwDo:eg:G:z:mK:S:", options, NULL)) != -1) switch (c) {
 		case 'u':
 			global.upload_max = strtoul(optarg, NULL, 10) * 1024;
 			break;
 		case 'U':
 			global.upload_dir = optarg;
 			break;
+		case 'r':
+			global.raw_body = 1;
+			break;
+		case 'p':
+			global.profile_file = optarg;
+			break;
+		case 'P':
+			global.profile_rate = strtoul(optarg, NULL, 10);
+			if (global.profile_rate <= 0) {
+				global.profile_rate = 1;
+			}
+			break;
+		case 'i':
+			global.instr_max = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			global.time_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			global.defer_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			global.field_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			global.key_max = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			global.size_max = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'c':
+			global.cache_dir = optarg;
+			break;
+		case 'C':
+			global.cache_size = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'T':
+			global.template = 1;
+			break;
+		case 'w':
+			global.upload_pipeline = 1;
+			break;
+		case 'D':
+			global.upload_direct = 1;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "round-robin")) {
+				global.upload_policy = UPLOAD_ROUND_ROBIN;
+			} else if (!strcmp(optarg, "free")) {
+				global.upload_policy = UPLOAD_FREE;
+			} else if (!strcmp(optarg, "hash")) {
+				global.upload_policy = UPLOAD_HASH;
+			} else {
+				die("Invalid upload policy: %s", optarg);
+			}
+			break;
+		case 'e':
+			global.etag = 1;
+			break;
+		case 'g':
+			global.gc_pause = strtoul(optarg, NULL, 10);
+			break;
+		case 'G':
+			global.gc_stepmul = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			global.gc_threshold = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'm':
+			global.memory_report = 1;
+			break;
+		case 'K':
+			cookie_key = optarg;
+			break;
+		case 'S':
+			global.signed_cookies = optarg;
+			break;
 		case 'v':
 			puts(PACKAGE " version " VERSION " (" URL ")");
 			return 0;
 		case 'h':
 		case '?':
-			puts("Usage: " PACKAGE " [-v|--version] [-U dirspec|--upload-dir=dirspec] [-u limit|--upload-limit=limit] [--] FILENAME");
+			puts("Usage: " PACKAGE " [-v|--version] [-U dirspec|--upload-dir=dirspec] [-u limit|--upload-limit=limit] [-r|--raw-body] [-p file|--profile=file] [-P count|--profile-rate=count] [-i count|--instruction-limit=count] [-t seconds|--time-limit=seconds] [-d seconds|--defer-limit=seconds] [-f count|--field-limit=count] [-k length|--key-limit=length] [-s limit|--size-limit=limit] [-c dirspec|--cache-dir=dirspec] [-C size|--cache-size=size] [-T|--template] [-w|--upload-pipeline] [-D|--upload-direct] [-o policy|--upload-policy=policy] [-e|--etag] [-g percent|--gc-pause=percent] [-G percent|--gc-stepmul=percent] [-z size|--gc-threshold=size] [-m|--memory-report] [-K file|--cookie-key=file] [-S names|--signed-cookie=names] [--] FILENAME");
 			return c != 'h';
 	}
 
@@ -182,10 +285,46 @@ main(int argc, char **argv)
 		setuid(filestat.st_uid);
 	}
 
+	/* the key is read with the permissions of the script, since its path
+	 * comes from the script */
+	if (cookie_key) {
+		int fd = open(cookie_key, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			die_status(errno, "open: %s: %s", cookie_key, strerror(errno));
+		}
+		buffer_t buf;
+		buffer_init(&buf);
+		if (buffer_read(&buf, fd) == -1) {
+			die_status(errno, "read: %s: %s", cookie_key, strerror(errno));
+		}
+		close(fd);
+		global.cookie_key_len = buf.ptr - buf.data;
+		/* ignore a trailing newline */
+		if (global.cookie_key_len && buf.data[global.cookie_key_len - 1] == '\n') {
+			global.cookie_key_len--;
+		}
+		if (!global.cookie_key_len) {
+			die("Cookie key is empty");
+		}
+		global.cookie_key = buf.data;
+	} else if (global.signed_cookies) {
+		die("No cookie key specified");
+	}
+
+	/* a cached response is sent without running any lua */
+	if (global.cache_dir && response_cache_serve(filename)) {
+		return 0;
+	}
+
 	lua_init();
 	haserl();
 	lua_exec(filename);
+	lua_run_deferred();
+	if (global.memory_report) {
+		lua_report();
+	}
 	lua_close(global.L);
+	free(global.body);
 
 	return 0;
 }
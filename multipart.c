@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include <lua.h>
@@ -38,6 +39,8 @@ form_data_destroy(form_data_t *obj)
 		free(obj->tmpfile);
 	}
 	if (obj->fd != -1) {
+		/* don't close the file under the writer thread */
+		upload_flush();
 		if (obj->fd < -1) {
 			obj->fd = -obj->fd - 2;
 		}
@@ -72,6 +75,7 @@ multipart_handler(void)
 
 	sliding_buffer_t sbuf;
 	s_buffer_init(&sbuf, 0, CHUNK_SIZE);
+	sbuf.reader = input_read;
 
 	/* initialize a buffer and make sure it doesn't point to null */
 	buffer_t buf;
@@ -82,6 +86,10 @@ multipart_handler(void)
 	form_data_t form_data;
 	form_data_init(&form_data);
 
+	/* the limits apply to each table separately */
+	field_count_t post_count = { 0, 0 };
+	field_count_t form_count = { 0, 0 };
+
 	enum { DISCARD, BOUNDARY, HEADER, CONTENT } state = DISCARD;
 	str = boundary + 2; /* skip the leading CRLF initially */
 
@@ -174,11 +182,18 @@ multipart_handler(void)
 
 							if (form_data.fd == -1) {
 								/* if a file upload, but don't have an open fd, open one */
-								size_t len = strlen(global.upload_dir);
+								size_t len;
+								const char *dir = upload_dir(form_data.name, &len);
 								form_data.tmpfile = xmalloc(len + 8);
-								memcpy(form_data.tmpfile, global.upload_dir, len);
+								memcpy(form_data.tmpfile, dir, len);
 								memcpy(form_data.tmpfile + len, "/XXXXXX", 8);
-								if ((form_data.fd = mkstemp(form_data.tmpfile)) == -1) {
+								form_data.fd = mkostemp(form_data.tmpfile, global.upload_direct ? O_DIRECT : 0);
+								if (form_data.fd == -1 && global.upload_direct && errno == EINVAL) {
+									/* the file system doesn't support O_DIRECT */
+									memcpy(form_data.tmpfile + len, "/XXXXXX", 8);
+									form_data.fd = mkstemp(form_data.tmpfile);
+								}
+								if (form_data.fd == -1) {
 									free(boundary);
 									s_buffer_destroy(&sbuf);
 									buffer_destroy(&buf);
@@ -199,9 +214,7 @@ multipart_handler(void)
 				/* if we have an open file, write the chunk
 				 * if there was an error, invert the file descriptor
 				 * we need the descriptor later when we close it */
-				size_t count = sbuf.end - sbuf.begin;
-				ssize_t n = write(form_data.fd, sbuf.begin, count);
-				if (n != count || n == -1) {
+				if (upload_write(form_data.fd, sbuf.begin, sbuf.end - sbuf.begin) == -1) {
 					form_data.fd = -form_data.fd - 2;
 					unlink(form_data.tmpfile);
 				}
@@ -211,7 +224,18 @@ multipart_handler(void)
 			}
 
 			if (matched) {
+				/* the file is complete once all writes are done */
+				if (form_data.fd > -1 && upload_flush() == -1) {
+					form_data.fd = -form_data.fd - 2;
+					unlink(form_data.tmpfile);
+				}
+
 				if (form_data.fd > -1) {
+					/* the limits apply to the name the client sent, and the
+					 * path is ours, so only the file name counts */
+					field_check(&form_count, strlen(form_data.name), 0);
+					field_check(&form_count, strlen(form_data.name), strlen(form_data.filename));
+
 					/* this creates FORM.foo_path=tempfile */
 					buffer_add(&buf, form_data.name, strlen(form_data.name));
 					buffer_add(&buf, "_path", 5);
@@ -222,6 +246,7 @@ multipart_handler(void)
 					buffer_add(&buf, "_filename", 9);
 					lua_set("FORM", buf.data, buf.ptr - buf.data, form_data.filename, strlen(form_data.filename));
 				} else if (form_data.fd == -1) {
+					field_check(&post_count, strlen(form_data.name), buf.ptr - buf.data);
 					lua_set("POST", form_data.name, strlen(form_data.name), buf.data, buf.ptr - buf.data);
 				}
 				form_data_destroy(&form_data);
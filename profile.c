@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <lua.h>
+#include <lualib.h>
+#ifdef LUA_JITLIBNAME
+#include <luajit.h>
+#endif
+
+#include "common.h"
+#include "buffer.h"
+
+/* deeper stacks are truncated at the root */
+#define MAX_DEPTH 64
+
+typedef struct {
+	char     *stack;  /* folded stack, root first, frames separated by ';' */
+	uint64_t  hash;   /* hash of stack */
+	size_t    count;  /* number of samples with this stack */
+} sample_t;
+
+static sample_t *samples = NULL;
+static size_t samples_len = 0;
+static size_t samples_cap = 0;
+static buffer_t stack;
+
+/* open addressing with linear probing, samples_cap is a power of two */
+static sample_t *
+sample_lookup(sample_t *table, size_t cap, uint64_t hash, const char *s)
+{
+	size_t i = hash & (cap - 1);
+	while (table[i].stack && (table[i].hash != hash || strcmp(table[i].stack, s))) {
+		i = (i + 1) & (cap - 1);
+	}
+	return &table[i];
+}
+
+static void
+samples_grow(void)
+{
+	size_t cap = samples_cap ? samples_cap * 2 : 256;
+	sample_t *table = xmalloc(sizeof(sample_t) * cap);
+	for (size_t i = 0; i < samples_cap; i++) {
+		if (samples[i].stack) {
+			*sample_lookup(table, cap, samples[i].hash, samples[i].stack) = samples[i];
+		}
+	}
+	free(samples);
+	samples = table;
+	samples_cap = cap;
+}
+
+static void
+frame_name(lua_State *L, lua_Debug *ar)
+{
+	lua_getinfo(L, "Sn", ar);
+
+	const char *name = ar->name ? ar->name : "?";
+	if (!strcmp(ar->what, "C")) {
+		buffer_add(&stack, name, strlen(name));
+	} else if (!strcmp(ar->what, "main")) {
+		buffer_add(&stack, ar->short_src, strlen(ar->short_src));
+	} else {
+		char line[32];
+		int len = snprintf(line, sizeof(line), ":%d", ar->linedefined);
+		buffer_add(&stack, name, strlen(name));
+		buffer_add(&stack, "@", 1);
+		buffer_add(&stack, ar->short_src, strlen(ar->short_src));
+		buffer_add(&stack, line, len);
+	}
+}
+
+/* count samples of the stack in the stack buffer */
+static void
+sample_add(int count)
+{
+	/* the folded format has one stack per line */
+	for (char *s = stack.data; s < stack.ptr; s++) {
+		if (*s == '\n') *s = ' ';
+	}
+	buffer_add(&stack, "", 1);
+
+	if (samples_len * 2 >= samples_cap) {
+		samples_grow();
+	}
+
+	uint64_t hash = fnv1a(FNV1A_INIT, stack.data, stack.ptr - stack.data);
+	sample_t *sample = sample_lookup(samples, samples_cap, hash, stack.data);
+	if (!sample->stack) {
+		sample->stack = xstrdup(stack.data);
+		sample->hash = hash;
+		samples_len++;
+	}
+	sample->count += count;
+}
+
+/* record the current lua stack, called from the count hook */
+void
+profile_sample(lua_State *L)
+{
+	lua_Debug ar[MAX_DEPTH];
+	int depth = 0;
+	while (depth < MAX_DEPTH && lua_getstack(L, depth, &ar[depth])) {
+		depth++;
+	}
+	if (!depth) {
+		return;
+	}
+
+	buffer_reset(&stack);
+	while (depth--) {
+		frame_name(L, &ar[depth]);
+		if (depth) {
+			buffer_add(&stack, ";", 1);
+		}
+	}
+	sample_add(1);
+}
+
+#ifdef LUAJIT_VERSION
+/* called back by the LuaJIT profiler, which samples compiled code as well
+ * frames are function names (or module:line), root first */
+static void
+profile_callback(void *data, lua_State *L, int count, int vmstate)
+{
+	size_t len;
+	const char *s = luaJIT_profile_dumpstack(L, "fZ;", -MAX_DEPTH, &len);
+	if (!len) {
+		return;
+	}
+
+	buffer_reset(&stack);
+	buffer_add(&stack, s, len);
+	sample_add(count);
+}
+#endif
+
+/* append the folded stacks to the profile file
+ * everything is written at once, so concurrent requests can share a file */
+static void
+profile_write(void)
+{
+	buffer_t out;
+	buffer_init(&out);
+
+	for (size_t i = 0; i < samples_cap; i++) {
+		if (samples[i].stack) {
+			char count[32];
+			int len = snprintf(count, sizeof(count), " %zu\n", samples[i].count);
+			buffer_add(&out, samples[i].stack, strlen(samples[i].stack));
+			buffer_add(&out, count, len);
+			free(samples[i].stack);
+		}
+	}
+	free(samples);
+	samples = NULL;
+	samples_len = samples_cap = 0;
+	buffer_destroy(&stack);
+
+	if (out.ptr != out.data) {
+		int fd = open(global.profile_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1 || write(fd, out.data, out.ptr - out.data) == -1) {
+			dprintf(2, "%s: %s\n", global.profile_file, strerror(errno));
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	buffer_destroy(&out);
+}
+
+/* under LuaJIT the stack is sampled every millisecond by its own profiler,
+ * otherwise the count hook calls profile_sample()
+ * lua_close() stops the LuaJIT profiler */
+void
+profile_start(lua_State *L)
+{
+	buffer_init(&stack);
+	atexit(profile_write);
+#ifdef LUAJIT_VERSION
+	luaJIT_profile_start(L, "fi1", profile_callback, NULL);
+#endif
+}
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "common.h"
+#include "buffer.h"
+
+/* cached responses are stored in the cache directory as
+ *   hash(script).vary  the elements the script's responses vary on, one per line
+ *   n.resp             a header, the key and the response
+ * where the key is made of the script, its modification time and the values
+ * of the elements it varies on, and n is its hash modulo RESPONSE_FILES
+ * responses sharing a file replace each other, which bounds the space used
+ * no matter how many values clients send */
+
+#define RESPONSE_MAGIC 0x6c707372
+/* number of files responses are stored in */
+#define RESPONSE_FILES 1024
+/* largest response stored */
+#define RESPONSE_MAX (1024 * 1024)
+
+typedef struct {
+	int64_t magic;
+	int64_t expires;
+	int64_t key_size;
+} response_header_t;
+
+/* set by haserl.cache_response() */
+static lua_Integer response_ttl = 0;
+static buffer_t response_vary;
+
+static int
+is_get(void)
+{
+	char *request_method = getenv("REQUEST_METHOD");
+	return request_method && !strcasecmp(request_method, "GET");
+}
+
+static char *
+vary_path(const char *filename)
+{
+	return cache_path(fnv1a(FNV1A_INIT, filename, strlen(filename)), "vary");
+}
+
+static char *
+response_path(const buffer_t *key)
+{
+	return cache_path(fnv1a(FNV1A_INIT, key->data, key->ptr - key->data) % RESPONSE_FILES, "resp");
+}
+
+/* build the key of the current request from the vary list
+ * returns 0 if the script doesn't exist */
+static int
+response_key(buffer_t *key, const char *filename, const char *vary, size_t vary_size)
+{
+	struct stat st;
+	if (stat(filename, &st)) {
+		return 0;
+	}
+
+	buffer_add(key, filename, strlen(filename) + 1);
+	buffer_add(key, &st.st_mtim, sizeof(st.st_mtim));
+
+	const char *end = vary + vary_size;
+	while (vary < end) {
+		const char *nl = memchr(vary, '\n', end - vary);
+		if (!nl) {
+			break;
+		}
+
+		/* "GET.name" or "COOKIE.name" */
+		const char *dot = memchr(vary, '.', nl - vary);
+		if (dot) {
+			char *tbl = xstrndup(vary, dot - vary);
+			char *name = xstrndup(dot + 1, nl - dot - 1);
+			size_t size;
+			char *value = haserl_lookup(tbl, name, &size);
+
+			buffer_add(key, vary, nl - vary + 1);
+			if (value) {
+				buffer_add(key, &size, sizeof(size));
+				buffer_add(key, value, size);
+			} else {
+				buffer_add(key, "", 1);
+			}
+
+			free(value);
+			free(name);
+			free(tbl);
+		}
+
+		vary = nl + 1;
+	}
+
+	return 1;
+}
+
+/* find the blank line ending the headers of a response
+ * returns the length of the headers including the newline of the last one, or
+ * -1 if there is no blank line */
+static ssize_t
+header_size(const char *data, size_t size)
+{
+	const char *end = data + size;
+	for (const char *s = data; s < end; s++) {
+		if (*s != '\n') continue;
+		if (s + 1 < end && s[1] == '\n') {
+			return s + 1 - data;
+		} else if (s + 2 < end && s[1] == '\r' && s[2] == '\n') {
+			return s + 1 - data;
+		}
+	}
+	return -1;
+}
+
+/* find a header, returns a pointer to the beginning of its line or NULL */
+static const char *
+header_find(const char *headers, size_t size, const char *name)
+{
+	size_t len = strlen(name);
+	const char *end = headers + size;
+	const char *s = headers;
+	while (s < end) {
+		if (end - s > len && !strncasecmp(s, name, len)) {
+			return s;
+		}
+		if (!(s = memchr(s, '\n', end - s))) {
+			break;
+		}
+		s++;
+	}
+	return NULL;
+}
+
+/* is the status of a response 200, either explicitly or by default
+ * a status line ("HTTP/1.0 500 ..." as sent by die()) is never taken as 200,
+ * since the response can't be changed without replacing it */
+static int
+status_ok(const char *headers, size_t size)
+{
+	if (size >= 5 && !strncmp(headers, "HTTP/", 5)) {
+		return 0;
+	}
+
+	const char *status = header_find(headers, size, "Status:");
+	return !status || !strncmp(status + 7 + strspn(status + 7, " \t"), "200", 3);
+}
+
+static void
+write_all(const struct iovec *iov, int iovcnt)
+{
+	ssize_t size = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		size += iov[i].iov_len;
+	}
+
+	ssize_t n = writev(1, iov, iovcnt);
+	if (n != size || n == -1) {
+		die_status(errno, "write: %s", strerror(errno));
+	}
+}
+
+/* send the response of the script
+ * with --etag, an ETag header is added to successful responses, and if the
+ * client already has the same body a bodyless 304 is sent instead */
+void
+response_write(const char *data, size_t size)
+{
+	ssize_t headers = global.etag ? header_size(data, size) : -1;
+	if (headers == -1 || header_find(data, headers, "ETag:") || !status_ok(data, headers)) {
+		struct iovec iov = { (void *)data, size };
+		write_all(&iov, 1);
+		return;
+	}
+
+	/* the body follows the blank line */
+	const char *body = data + headers + (data[headers] == '\r' ? 2 : 1);
+	char tag[19];
+	snprintf(tag, sizeof(tag), "\"%016llx\"", (unsigned long long)fnv1a(FNV1A_INIT, body, data + size - body));
+	char etag[32];
+	int len = snprintf(etag, sizeof(etag), "ETag: %s\r\n", tag);
+
+	/* other methods have had their effect, so their response must be sent */
+	const char *method = getenv("REQUEST_METHOD");
+	const char *match = getenv("HTTP_IF_NONE_MATCH");
+	if (method && (!strcasecmp(method, "GET") || !strcasecmp(method, "HEAD")) &&
+	    match && (strstr(match, tag) || !strcmp(match, "*"))) {
+		/* keep the other headers, but drop the status and length of the body */
+		buffer_t buf;
+		buffer_init(&buf);
+		buffer_add_literal(&buf, "Status: 304 Not Modified\r\n");
+
+		const char *end = data + headers;
+		for (const char *s = data; s < end;) {
+			const char *nl = memchr(s, '\n', end - s);
+			nl = nl ? nl + 1 : end;
+			if (strncasecmp(s, "Status:", 7) && strncasecmp(s, "Content-Length:", 15)) {
+				buffer_add(&buf, s, nl - s);
+			}
+			s = nl;
+		}
+
+		buffer_add(&buf, etag, len);
+		buffer_add_literal(&buf, "\r\n");
+		struct iovec iov = { buf.data, buf.ptr - buf.data };
+		write_all(&iov, 1);
+		buffer_destroy(&buf);
+		return;
+	}
+
+	struct iovec iov[] = {
+		{ (void *)data, headers },
+		{ etag, len },
+		{ (void *)(data + headers), size - headers },
+	};
+	write_all(iov, 3);
+}
+
+/* write a cached response for this request if there is a fresh one
+ * returns 1 if the response was sent */
+int
+response_cache_serve(const char *filename)
+{
+	if (!is_get()) {
+		return 0;
+	}
+
+	char *path = vary_path(filename);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return 0;
+	}
+
+	buffer_t vary;
+	buffer_init(&vary);
+	ssize_t n = buffer_read(&vary, fd);
+	close(fd);
+
+	buffer_t key;
+	buffer_init(&key);
+	if (n == -1 || !response_key(&key, filename, vary.data, vary.ptr - vary.data)) {
+		buffer_destroy(&vary);
+		buffer_destroy(&key);
+		return 0;
+	}
+	buffer_destroy(&vary);
+
+	size_t key_size = key.ptr - key.data;
+	path = response_path(&key);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	buffer_t buf;
+	buffer_init(&buf);
+
+	int ret = 0;
+	response_header_t header;
+	if (fd != -1 &&
+	    read(fd, &header, sizeof(header)) == sizeof(header) &&
+	    header.magic == RESPONSE_MAGIC) {
+		if (header.expires <= time(NULL)) {
+			/* whichever response it is, it is of no use to anyone */
+			unlink(path);
+		} else if (header.key_size == key_size &&
+		           buffer_read(&buf, fd) != -1 &&
+		           buf.ptr - buf.data >= key_size &&
+		           !memcmp(buf.data, key.data, key_size)) {
+			response_write(buf.data + key_size, buf.ptr - buf.data - key_size);
+			ret = 1;
+		}
+	}
+
+	if (fd != -1) {
+		close(fd);
+	}
+	free(path);
+	buffer_destroy(&buf);
+	buffer_destroy(&key);
+	return ret;
+}
+
+/* store the response if the script asked for it
+ * failing silently, since the cache is optional */
+void
+response_cache_store(const char *filename, const char *data, size_t size)
+{
+	if (!response_ttl || !is_get() || size > RESPONSE_MAX) {
+		return;
+	}
+
+	/* only successful responses that are the same for every client */
+	ssize_t headers = header_size(data, size);
+	if (headers == -1 || !status_ok(data, headers) || header_find(data, headers, "Set-Cookie:")) {
+		return;
+	}
+
+	size_t vary_size = response_vary.ptr - response_vary.data;
+	char *path = vary_path(filename);
+	struct iovec vary_iov = { response_vary.data, vary_size };
+	int err = cache_write(path, &vary_iov, 1);
+	free(path);
+
+	buffer_t key;
+	buffer_init(&key);
+	if (err || !response_key(&key, filename, response_vary.data, vary_size)) {
+		buffer_destroy(&key);
+		return;
+	}
+
+	response_header_t header = {
+		.magic = RESPONSE_MAGIC,
+		.expires = time(NULL) + response_ttl,
+		.key_size = key.ptr - key.data,
+	};
+	struct iovec iov[] = {
+		{ &header, sizeof(header) },
+		{ key.data, key.ptr - key.data },
+		{ (void *)data, size },
+	};
+
+	path = response_path(&key);
+	cache_write(path, iov, 3);
+	free(path);
+	buffer_destroy(&key);
+}
+
+/* haserl.cache_response(ttl[, vary]) caches the output of the script for ttl
+ * seconds, separately for each combination of the values of the elements
+ * listed in vary, e.g. { "GET.page", "COOKIE.lang" } */
+static int
+lua_cache_response(lua_State *L)
+{
+	lua_Integer ttl = luaL_checkinteger(L, 1);
+	response_ttl = 0;
+	buffer_reset(&response_vary);
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		for (int i = 1; ; i++) {
+			lua_rawgeti(L, 2, i);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+
+			size_t len;
+			const char *s = lua_tolstring(L, -1, &len);
+			if (!s || (strncmp(s, "GET.", 4) && strncmp(s, "COOKIE.", 7)) || strlen(s) != len || memchr(s, '\n', len)) {
+				return luaL_argerror(L, 2, "elements must be \"GET.name\" or \"COOKIE.name\"");
+			}
+			buffer_add(&response_vary, s, len);
+			buffer_add(&response_vary, "\n", 1);
+			lua_pop(L, 1);
+		}
+	}
+
+	response_ttl = ttl > 0 ? ttl : 0;
+	return 0;
+}
+
+void
+response_cache_register(lua_State *L)
+{
+	lua_pushcfunction(L, lua_cache_response);
+}
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "common.h"
+#include "buffer.h"
+
+/* signed cookies look like
+ *   value.expires.mac
+ * where expires is a unix time (0 for never) and mac is the hex encoded
+ * HMAC-SHA256 of name, value and expires, separated by NUL bytes
+ * the value may contain dots, so the cookie is split from the right */
+
+#define SHA256_SIZE 32
+#define SHA256_BLOCK 64
+#define MAC_HEX_SIZE (SHA256_SIZE * 2)
+
+typedef struct {
+	uint32_t      state[8];
+	uint64_t      size;   /* bytes hashed so far */
+	unsigned char block[SHA256_BLOCK];
+} sha256_t;
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_transform(sha256_t *ctx, const unsigned char *block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+		       (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+	uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+#undef ror
+
+static void
+sha256_init(sha256_t *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->size = 0;
+}
+
+static void
+sha256_update(sha256_t *ctx, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	while (size) {
+		size_t used = ctx->size % SHA256_BLOCK;
+		size_t n = SHA256_BLOCK - used;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(ctx->block + used, p, n);
+		ctx->size += n;
+		p += n;
+		size -= n;
+		if (ctx->size % SHA256_BLOCK == 0) {
+			sha256_transform(ctx, ctx->block);
+		}
+	}
+}
+
+static void
+sha256_final(sha256_t *ctx, unsigned char *digest)
+{
+	uint64_t bits = ctx->size * 8;
+	unsigned char pad[SHA256_BLOCK + 8] = { 0x80 };
+	size_t used = ctx->size % SHA256_BLOCK;
+	size_t n = (used < 56 ? 56 : 120) - used;
+	for (int i = 0; i < 8; i++) {
+		pad[n + i] = bits >> (56 - i * 8);
+	}
+	sha256_update(ctx, pad, n + 8);
+
+	for (int i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
+
+/* hex encoded HMAC-SHA256 of name, value and expires */
+static void
+cookie_mac(char *hex, const char *key, size_t key_size, const char *name, size_t name_size,
+           const char *value, size_t value_size, const char *expires, size_t expires_size)
+{
+	unsigned char pad[SHA256_BLOCK] = { 0 };
+	unsigned char digest[SHA256_SIZE];
+	sha256_t ctx;
+
+	if (key_size > SHA256_BLOCK) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, key_size);
+		sha256_final(&ctx, pad);
+	} else {
+		memcpy(pad, key, key_size);
+	}
+
+	/* inner hash */
+	for (int i = 0; i < SHA256_BLOCK; i++) {
+		pad[i] ^= 0x36;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, SHA256_BLOCK);
+	sha256_update(&ctx, name, name_size);
+	sha256_update(&ctx, "", 1);
+	sha256_update(&ctx, value, value_size);
+	sha256_update(&ctx, "", 1);
+	sha256_update(&ctx, expires, expires_size);
+	sha256_final(&ctx, digest);
+
+	/* outer hash */
+	for (int i = 0; i < SHA256_BLOCK; i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, SHA256_BLOCK);
+	sha256_update(&ctx, digest, SHA256_SIZE);
+	sha256_final(&ctx, digest);
+
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < SHA256_SIZE; i++) {
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xf];
+	}
+}
+
+/* check a signed cookie
+ * returns NULL and sets the size of its value (which starts the cookie) if it
+ * is valid, or the reason it isn't */
+const char *
+cookie_verify(const char *name, size_t name_size, const char *cookie, size_t size,
+              const char *key, size_t key_size, size_t *value_size, int64_t *expires)
+{
+	const char *mac = memrchr(cookie, '.', size);
+	if (!mac || cookie + size - ++mac != MAC_HEX_SIZE) {
+		return "invalid";
+	}
+
+	const char *stamp = memrchr(cookie, '.', mac - 1 - cookie);
+	if (!stamp) {
+		return "invalid";
+	}
+	stamp++;
+	*value_size = stamp - 1 - cookie;
+
+	char hex[MAC_HEX_SIZE];
+	cookie_mac(hex, key, key_size, name, name_size, cookie, *value_size, stamp, mac - 1 - stamp);
+
+	/* compare all of it, so the time taken doesn't tell how much matched */
+	unsigned char diff = 0;
+	for (int i = 0; i < MAC_HEX_SIZE; i++) {
+		diff |= hex[i] ^ mac[i];
+	}
+	if (diff) {
+		return "invalid";
+	}
+
+	/* the mac covers the stamp, so it was written by haserl.sign_cookie() */
+	*expires = strtoll(stamp, NULL, 10);
+	if (*expires && *expires <= time(NULL)) {
+		return "expired";
+	}
+
+	return NULL;
+}
+
+/* the key passed as argument n, or the one read from --cookie-key, which
+ * isn't NUL terminated */
+static const char *
+cookie_key(lua_State *L, int n, size_t *key_size)
+{
+	if (lua_isnoneornil(L, n)) {
+		*key_size = global.cookie_key_len;
+		return global.cookie_key;
+	}
+	return luaL_checklstring(L, n, key_size);
+}
+
+/* haserl.sign_cookie(name, value [, key [, ttl]]) */
+static int
+lua_sign_cookie(lua_State *L)
+{
+	size_t name_size, value_size, key_size;
+	const char *name = luaL_checklstring(L, 1, &name_size);
+	const char *value = luaL_checklstring(L, 2, &value_size);
+	const char *key = cookie_key(L, 3, &key_size);
+	lua_Integer ttl = luaL_optinteger(L, 4, 0);
+	if (!key) {
+		return luaL_error(L, "No cookie key specified");
+	}
+
+	char expires[24];
+	int expires_size = snprintf(expires, sizeof(expires), "%lld",
+	                            ttl > 0 ? (long long)time(NULL) + ttl : 0LL);
+
+	char hex[MAC_HEX_SIZE];
+	cookie_mac(hex, key, key_size, name, name_size, value, value_size, expires, expires_size);
+
+	buffer_t buf;
+	buffer_init(&buf);
+	buffer_add(&buf, value, value_size);
+	buffer_add_literal(&buf, ".");
+	buffer_add(&buf, expires, expires_size);
+	buffer_add_literal(&buf, ".");
+	buffer_add(&buf, hex, MAC_HEX_SIZE);
+	lua_pushlstring(L, buf.data, buf.ptr - buf.data);
+	buffer_destroy(&buf);
+
+	return 1;
+}
+
+/* haserl.verify_cookie(name [, key])
+ * checks the cookie as it was sent, so cookies verified with --signed-cookie
+ * can be checked again */
+static int
+lua_verify_cookie(lua_State *L)
+{
+	size_t name_size, key_size;
+	const char *name = luaL_checklstring(L, 1, &name_size);
+	const char *key = cookie_key(L, 2, &key_size);
+	if (!key) {
+		return luaL_error(L, "No cookie key specified");
+	}
+
+	size_t size;
+	char *cookie = haserl_lookup("COOKIE", name, &size);
+	if (!cookie) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "missing");
+		return 2;
+	}
+
+	size_t value_size;
+	int64_t expires;
+	const char *error = cookie_verify(name, name_size, cookie, size, key, key_size, &value_size, &expires);
+	if (error) {
+		free(cookie);
+		lua_pushnil(L);
+		lua_pushstring(L, error);
+		return 2;
+	}
+
+	lua_pushlstring(L, cookie, value_size);
+	lua_pushinteger(L, expires);
+	free(cookie);
+	return 2;
+}
+
+/* add sign_cookie and verify_cookie to the table on top of the stack */
+void
+sign_register(lua_State *L)
+{
+	lua_pushcfunction(L, lua_sign_cookie);
+	lua_setfield(L, -2, "sign_cookie");
+	lua_pushcfunction(L, lua_verify_cookie);
+	lua_setfield(L, -2, "verify_cookie");
+}
@@ -20,6 +20,7 @@ s_buffer_init(sliding_buffer_t *sbuf, int fd, size_t size)
 	sbuf->next = sbuf->buf;
 	sbuf->fd = fd;
 	sbuf->read = 0;
+	sbuf->reader = read;
 }
 
 void
@@ -34,6 +35,7 @@ s_buffer_destroy(sliding_buffer_t *sbuf)
 	sbuf->next = NULL;
 	sbuf->fd = -1;
 	sbuf->read = 0;
+	sbuf->reader = NULL;
 }
 
 /* read the next segment from a sliding buffer
@@ -64,7 +66,7 @@ s_buffer_read(sliding_buffer_t *sbuf, const char *matchstr)
 
 		/* if fd is invalid, we are at EOF
 		 * pigeonhole errors and EOF */
-		if (fcntl(sbuf->fd, F_GETFL) != -1 && (sbuf->read = read(sbuf->fd, sbuf->ptr, sbuf->limit - sbuf->ptr)) > 0) {
+		if (fcntl(sbuf->fd, F_GETFL) != -1 && (sbuf->read = sbuf->reader(sbuf->fd, sbuf->ptr, sbuf->limit - sbuf->ptr)) > 0) {
 			sbuf->ptr += sbuf->read;
 		} else {
 			sbuf->read = -1;
@@ -10,6 +10,7 @@ typedef struct {
 	char    *next;   /* beginning of the next segment */
 	int      fd;     /* input file descriptor for the buffer */
 	ssize_t  read;   /* number of bytes read from fd */
+	ssize_t (*reader)(int, void *, size_t); /* read(2) or a replacement */
 } sliding_buffer_t;
 
 void s_buffer_init(sliding_buffer_t *sbuf, int fd, size_t size);
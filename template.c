@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "common.h"
+#include "buffer.h"
+
+#define TEMPLATE_MAGIC 0x6c707468
+
+/* prepended to compiled templates in the cache directory */
+typedef struct {
+	int64_t magic;
+	int64_t mtime;       /* of the template */
+	int64_t mtime_nsec;
+	int64_t size;
+} template_header_t;
+
+/* add static text as a quoted lua string, followed by one newline for each
+ * newline in the text to keep line numbers in error messages intact
+ * extra is the number of lines the code is ahead of the template, which are
+ * made up for here */
+static void
+add_text(buffer_t *code, const char *s, size_t len, int *extra)
+{
+	if (!len) {
+		return;
+	}
+
+	int lines = 0;
+	buffer_add_literal(code, "__buffer[#__buffer + 1] = \"");
+	for (const char *end = s + len; s < end; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			buffer_add(code, "\\", 1);
+			buffer_add(code, s, 1);
+		} else if (c == '\n') {
+			buffer_add(code, "\\n", 2);
+			lines++;
+		} else if (c < ' ' || c == 127) {
+			char esc[5];
+			snprintf(esc, sizeof(esc), "\\%03d", c);
+			buffer_add(code, esc, 4);
+		} else {
+			buffer_add(code, s, 1);
+		}
+	}
+	buffer_add_literal(code, "\"; ");
+	for (; lines && *extra; lines--) {
+		--*extra;
+	}
+	while (lines--) {
+		buffer_add(code, "\n", 1);
+	}
+}
+
+/* translate a template into lua code
+ * <% code %> is copied verbatim, <%= expr %> is replaced by its value and
+ * everything else is output as is */
+static int
+template_compile(lua_State *L, const char *filename, const char *s, size_t len, buffer_t *code)
+{
+	const char *end = s + len;
+	int extra = 0;
+
+	buffer_add_literal(code, "local __buffer = BUFFER; ");
+
+	/* skip the #! line */
+	if (len && *s == '#') {
+		while (s < end && *s++ != '\n');
+		buffer_add(code, "\n", 1);
+	}
+
+	while (s < end) {
+		const char *open = memmem(s, end - s, "<%", 2);
+		if (!open) {
+			add_text(code, s, end - s, &extra);
+			break;
+		}
+		add_text(code, s, open - s, &extra);
+
+		open += 2;
+		int expr = open < end && *open == '=';
+		if (expr) {
+			open++;
+		}
+
+		const char *close = memmem(open, end - open, "%>", 2);
+		if (!close) {
+			lua_pushfstring(L, "%s: unterminated <%%", filename);
+			return LUA_ERRSYNTAX;
+		}
+
+		s = close + 2;
+		if (expr) {
+			buffer_add_literal(code, "__buffer[#__buffer + 1] = tostring(");
+			buffer_add(code, open, close - open);
+			buffer_add_literal(code, "); ");
+		} else {
+			/* a newline after a code block is part of the code, so scripts can
+			 * print headers from consecutive lines. a block that may end in a
+			 * comment needs one either way, so the comment doesn't swallow
+			 * what follows, and the line numbers catch up later */
+			int comment = memmem(open, close - open, "--", 2) != NULL;
+			int newline = s < end && *s == '\n';
+			if (newline) {
+				s++;
+			}
+
+			buffer_add(code, open, close - open);
+			if (comment || (newline && !extra)) {
+				buffer_add(code, "\n", 1);
+				extra += !newline;
+			} else {
+				buffer_add(code, " ", 1);
+				extra -= newline;
+			}
+		}
+	}
+
+	lua_pushfstring(L, "@%s", filename);
+	int ret = luaL_loadbuffer(L, code->data, code->ptr - code->data, lua_tostring(L, -1));
+	lua_remove(L, -2);
+	return ret;
+}
+
+static int
+template_writer(lua_State *L, const void *p, size_t size, void *buf)
+{
+	buffer_add(buf, p, size);
+	return 0;
+}
+
+/* load the compiled template if it is still up to date
+ * returns 1 if the function was pushed onto the stack */
+static int
+template_cache_load(lua_State *L, const char *path, const char *filename, const template_header_t *header)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return 0;
+	}
+
+	buffer_t buf;
+	buffer_init(&buf);
+
+	template_header_t cached;
+	int ret = read(fd, &cached, sizeof(cached)) == sizeof(cached) &&
+	          !memcmp(&cached, header, sizeof(cached)) &&
+	          buffer_read(&buf, fd) != -1;
+	close(fd);
+
+	if (ret && luaL_loadbuffer(L, buf.data, buf.ptr - buf.data, filename)) {
+		/* unusable, recompile */
+		lua_pop(L, 1);
+		ret = 0;
+	}
+
+	buffer_destroy(&buf);
+	return ret;
+}
+
+/* store the compiled template, failing silently since the cache is optional */
+static void
+template_cache_store(lua_State *L, const char *path, const template_header_t *header)
+{
+	buffer_t buf;
+	buffer_init(&buf);
+	lua_dump(L, template_writer, &buf);
+
+	struct iovec iov[] = {
+		{ (void *)header, sizeof(*header) },
+		{ buf.data, buf.ptr - buf.data },
+	};
+	cache_write(path, iov, 2);
+
+	buffer_destroy(&buf);
+}
+
+/* load a template as a lua function, like luaL_loadfile()
+ * with a cache directory, the compiled function is reused for as long as the
+ * modification time and size of the template don't change */
+int
+template_load(lua_State *L, const char *filename)
+{
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st)) {
+		lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+		}
+		return LUA_ERRFILE;
+	}
+
+	template_header_t header = {
+		.magic = TEMPLATE_MAGIC,
+		.mtime = st.st_mtim.tv_sec,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+		.size = st.st_size,
+	};
+
+	/* keyed by the file rather than its name, which differs with the path
+	 * the template is run by */
+	struct {
+		dev_t dev;
+		ino_t ino;
+	} id = { st.st_dev, st.st_ino };
+	char *path = global.cache_dir ? cache_path(fnv1a(FNV1A_INIT, &id, sizeof(id)), "tpl") : NULL;
+	if (path && template_cache_load(L, path, filename, &header)) {
+		close(fd);
+		free(path);
+		return 0;
+	}
+
+	buffer_t buf;
+	buffer_init(&buf);
+
+	if (buffer_read(&buf, fd) == -1) {
+		lua_pushfstring(L, "cannot read %s: %s", filename, strerror(errno));
+		close(fd);
+		free(path);
+		buffer_destroy(&buf);
+		return LUA_ERRFILE;
+	}
+	close(fd);
+
+	buffer_t code;
+	buffer_init(&code);
+	int ret = template_compile(L, filename, buf.data, buf.ptr - buf.data, &code);
+	buffer_destroy(&code);
+	buffer_destroy(&buf);
+
+	if (!ret && path) {
+		template_cache_store(L, path, &header);
+	}
+	free(path);
+
+	return ret;
+}
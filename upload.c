@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#include <lua.h>
+
+#include "common.h"
+
+/* uploaded data is collected into large aligned blocks before it is written,
+ * which also allows writing with O_DIRECT. with the pipeline enabled, a ring
+ * of blocks is written out by a writer thread, so reading the request and
+ * writing to disk overlap
+ *
+ * buffers[tail] to buffers[tail + queued - 1] are owned by the writer thread,
+ * the main thread fills buffers[head] */
+#define UPLOAD_BUFFERS 4
+/* 1M */
+#define UPLOAD_BLOCK 1024 * 1024
+/* alignment of the blocks in memory and on disk, as O_DIRECT requires */
+#define UPLOAD_ALIGN 4096
+
+typedef struct {
+	char   *data;
+	size_t  size;
+	int     fd;
+} upload_buffer_t;
+
+static upload_buffer_t buffers[UPLOAD_BUFFERS];
+static size_t nbuffers = 0;   /* number of allocated buffers */
+static size_t head = 0;
+static size_t tail = 0;
+static size_t queued = 0;
+static int error = 0;         /* a write failed since the last flush */
+static int running = 0;       /* the writer thread was started */
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static int
+write_block(upload_buffer_t *buf)
+{
+	/* only the last block of a file can be partial, which O_DIRECT won't
+	 * write, so turn it off for the rest of the file */
+	if (buf->size % UPLOAD_ALIGN) {
+		int flags = fcntl(buf->fd, F_GETFL);
+		if (flags != -1 && flags & O_DIRECT) {
+			fcntl(buf->fd, F_SETFL, flags & ~O_DIRECT);
+		}
+	}
+
+	const char *data = buf->data;
+	size_t size = buf->size;
+	while (size) {
+		ssize_t n = write(buf->fd, data, size);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void *
+upload_writer(void *arg)
+{
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!queued) {
+			pthread_cond_wait(&cond, &lock);
+		}
+
+		upload_buffer_t *buf = &buffers[tail];
+		pthread_mutex_unlock(&lock);
+		int ret = write_block(buf);
+		pthread_mutex_lock(&lock);
+
+		error |= ret;
+		buf->size = 0;
+		tail = (tail + 1) % UPLOAD_BUFFERS;
+		queued--;
+		pthread_cond_broadcast(&cond);
+	}
+	return NULL;
+}
+
+static upload_buffer_t *
+upload_alloc(upload_buffer_t *buf)
+{
+	if (posix_memalign((void **)&buf->data, UPLOAD_ALIGN, UPLOAD_BLOCK)) {
+		die("posix_memalign: %s", strerror(ENOMEM));
+	}
+	buf->size = 0;
+	buf->fd = -1;
+	return buf;
+}
+
+static void
+upload_start(void)
+{
+	upload_alloc(&buffers[0]);
+	nbuffers = 1;
+	if (!global.upload_pipeline) {
+		return;
+	}
+
+	for (; nbuffers < UPLOAD_BUFFERS; nbuffers++) {
+		upload_alloc(&buffers[nbuffers]);
+	}
+
+	/* if there is no thread, the blocks are written synchronously
+	 * the thread is simply discarded at exit */
+	if (!pthread_create(&writer, NULL, upload_writer, NULL)) {
+		pthread_detach(writer);
+		running = 1;
+	}
+}
+
+/* write out buffers[head], or hand it to the writer thread and wait for a
+ * free buffer */
+static void
+upload_queue(void)
+{
+	if (!running) {
+		error |= write_block(&buffers[head]);
+		buffers[head].size = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	head = (head + 1) % UPLOAD_BUFFERS;
+	queued++;
+	pthread_cond_broadcast(&cond);
+	while (queued == UPLOAD_BUFFERS) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* write uploaded data to fd
+ * returns -1 if a write failed */
+int
+upload_write(int fd, const char *data, size_t size)
+{
+	if (!nbuffers) {
+		upload_start();
+	}
+
+	while (size) {
+		upload_buffer_t *buf = &buffers[head];
+		if (buf->size && buf->fd != fd) {
+			upload_queue();
+			continue;
+		}
+
+		size_t n = UPLOAD_BLOCK - buf->size;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(buf->data + buf->size, data, n);
+		buf->size += n;
+		buf->fd = fd;
+		data += n;
+		size -= n;
+
+		if (buf->size == UPLOAD_BLOCK) {
+			upload_queue();
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	int ret = error ? -1 : 0;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* wait until everything passed to upload_write() is written
+ * returns -1 if any write failed since the last flush */
+int
+upload_flush(void)
+{
+	if (!nbuffers) {
+		return 0;
+	}
+
+	if (buffers[head].size) {
+		upload_queue();
+	}
+
+	pthread_mutex_lock(&lock);
+	while (queued) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	int ret = error ? -1 : 0;
+	error = 0;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* number of directories in upload_dir */
+static size_t
+upload_dirs(void)
+{
+	size_t n = 1;
+	for (const char *s = global.upload_dir; (s = strchr(s, ':')); s++) {
+		n++;
+	}
+	return n;
+}
+
+/* the i-th directory in upload_dir */
+static const char *
+upload_dir_nth(size_t i, size_t *len)
+{
+	const char *s = global.upload_dir;
+	while (i--) {
+		s = strchr(s, ':') + 1;
+	}
+	*len = strchrnul(s, ':') - s;
+	return s;
+}
+
+/* pick a directory from the colon separated list in upload_dir for an
+ * uploaded file of the form field name
+ * returns a pointer into upload_dir, and the length of the directory in len */
+const char *
+upload_dir(const char *name, size_t *len)
+{
+	static size_t counter = 0;
+
+	size_t n = upload_dirs();
+	size_t dir = 0;
+	if (n == 1) {
+		/* nothing to choose from */
+	} else if (global.upload_policy == UPLOAD_HASH) {
+		dir = fnv1a(FNV1A_INIT, name, strlen(name)) % n;
+	} else if (global.upload_policy == UPLOAD_FREE) {
+		unsigned long long max = 0;
+		for (size_t i = 0; i < n; i++) {
+			const char *s = upload_dir_nth(i, len);
+			char *path = xmalloc(*len + 1);
+			memcpy(path, s, *len);
+
+			struct statvfs st;
+			if (!statvfs(path, &st) && (unsigned long long)st.f_bavail * st.f_frsize > max) {
+				max = (unsigned long long)st.f_bavail * st.f_frsize;
+				dir = i;
+			}
+			free(path);
+		}
+	} else {
+		/* start at a different directory in each process, so concurrent
+		 * requests spread over all of them */
+		dir = (getpid() + counter++) % n;
+	}
+
+	return upload_dir_nth(dir, len);
+}
@@ -1,6 +1,8 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stdint.h>
+
 #define append(ptr, elem, len, cap) \
 	do { \
 		if (len >= cap) { \
@@ -11,11 +13,24 @@
 		len++; \
 	} while (0)
 
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+typedef struct {
+	size_t allocs;    /* calls to xmalloc() and xrealloc() */
+	size_t buffered;  /* bytes added to buffers */
+	size_t copied;    /* bytes passed to lua by the parsers */
+} stats_t;
+
+extern stats_t stats;
+
 void *xmalloc(size_t size);
 void *xrealloc(void *buf, size_t size);
 char *xstrdup(const char *s);
+char *xstrndup(const char *s, size_t n);
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
 void drain(int fd);
 void die(const char *s, ...);
 void die_status(int status, const char *s, ...);
+void die_unavailable(const char *s, ...);
 
 #endif /* _UTIL_H */